@@ -0,0 +1,313 @@
+/*
+    Copyright (C) 2024-2025 sys4 AG
+    Author Boris Lohner bl@sys4.de
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this program.
+    If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+Generates datagram-serializer.h from the schema of the datagrams sent to the TLSRPT collectd.
+Run "create-datagram-serializer > datagram-serializer.h" after changing the schema.
+The values of the constant attributes are taken from tlsrpt.h, so the program is built in the configured tree.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#include "tlsrpt.h"
+
+typedef enum field_type_t {
+  STRING, /* JSON-escaped string value */
+  INT, /* integer value */
+  STRINGS, /* list of JSON-escaped strings */
+  OBJECTS /* list of JSON objects */
+} field_type_t;
+
+typedef struct field_t {
+  const char* object; /* the JSON object the field belongs to */
+  const char* name; /* name of the generated constants and functions */
+  const char* key; /* JSON key in the datagram */
+  field_type_t type;
+  int first; /* the first field of its object is written without a leading "," separator */
+  int failurefield; /* position in tlsrpt_failure_field_t plus one, zero for other fields */
+  const char* description;
+} field_t;
+
+/* The schema of the datagrams, fields are listed in the order they are written */
+static const field_t schema[]={
+  {"delivery request", "datagram_protocol_version", "dpv", STRING, 1, 0, "version of the datagram protocol, \"1\" for a single delivery request, \"2\" for a batch"},
+  {"delivery request", "domain", "d", STRING, 0, 0, "recipient domain"},
+  {"delivery request", "policy_record", "pr", STRING, 0, 0, "TLSRPT policy record of the recipient domain"},
+  {"delivery request", "policies", "policies", OBJECTS, 0, 0, "the policies of the delivery request"},
+  {"delivery request", "dropped_policies", "dp", INT, 0, 0, "number of policies dropped by the policies limit, only present if policies were dropped"},
+  {"delivery request", "dropped_failures", "dt", INT, 0, 0, "total failure count of the dropped policies, only present if policies were dropped"},
+  {"delivery request or policy", "truncated", "tr", INT, 0, 0, "1 if details of the policy or delivery request were dropped or cut by a limit, only present if truncated"},
+  {"batch", "batch", "b", OBJECTS, 0, 0, "the delivery requests of a batch datagram"},
+  {"policy", "policy_type", "policy-type", INT, 1, 0, "tlsrpt_policy_type_t of the policy"},
+  {"policy", "policy_domain", "policy-domain", STRING, 0, 0, "policy domain, only present if given"},
+  {"policy", "policy_strings", "policy-string", STRINGS, 0, 0, "policy strings, only present if any were added"},
+  {"policy", "mx_hosts", "mx-host", STRINGS, 0, 0, "mx host patterns, only present if any were added"},
+  {"policy", "failure_details", "failure-details", OBJECTS, 0, 0, "distinct failure details, only present if any were added"},
+  {"policy", "failure_count", "t", INT, 0, 0, "total number of failures of the policy"},
+  {"policy", "final_result", "f", INT, 0, 0, "tlsrpt_final_result_t of the policy"},
+  {"failure detail", "failure_code", "c", INT, 1, 0, "failure_details.failure_code"},
+  {"failure detail", "sending_mta_ip", "s", STRING, 0, 1, "failure_details.sending_mta_ip"},
+  {"failure detail", "receiving_mx_hostname", "n", STRING, 0, 2, "failure_details.receiving_mx_hostname"},
+  {"failure detail", "receiving_mx_helo", "h", STRING, 0, 3, "failure_details.receiving_mx_helo"},
+  {"failure detail", "receiving_ip", "r", STRING, 0, 4, "failure_details.receiving_ip"},
+  {"failure detail", "additional_information", "a", STRING, 0, 5, "failure_details.additional_information"},
+  {"failure detail", "failure_reason_code", "f", STRING, 0, 6, "failure_details.failure_reason_code"},
+  {"failure detail", "failed_session_count", "k", INT, 0, 0, "failure_details.failed-session-count, only present if an identical failure was added more than once"},
+};
+
+#define SCHEMA_FIELDS ((int)(sizeof(schema)/sizeof(schema[0])))
+
+typedef struct constant_t {
+  const char* name; /* name of the generated constant */
+  const char* field; /* name of the schema field */
+  int value; /* value of an INT field */
+  const char* string; /* value of a STRING field */
+  const char* description;
+} constant_t;
+
+/* Attributes with a fixed value, written as one constant on the common paths */
+static const constant_t constants[]={
+  {"datagram_protocol_version_single", "datagram_protocol_version", 0, "1", "datagram of a single delivery request"},
+  {"datagram_protocol_version_batch", "datagram_protocol_version", 0, "2", "batch datagram"},
+  {"policy_type_no_policy_found", "policy_type", TLSRPT_NO_POLICY_FOUND, NULL, "policy of type TLSRPT_NO_POLICY_FOUND"},
+  {"failure_count_none", "failure_count", 0, NULL, "policy without failures"},
+  {"final_result_success", "final_result", TLSRPT_FINAL_SUCCESS, NULL, "policy with the final result TLSRPT_FINAL_SUCCESS"},
+  {"truncated", "truncated", 1, NULL, "policy or delivery request truncated by a limit"},
+};
+
+#define CONSTANTS ((int)(sizeof(constants)/sizeof(constants[0])))
+
+/* Number of failure detail string fields, in the order of tlsrpt_failure_field_t */
+#define FAILURE_FIELDS 6
+
+void print_license() {
+  printf("/*\n\
+    Copyright (C) 2024-2025 sys4 AG\n\
+    Author Boris Lohner bl@sys4.de\n\
+\n\
+    This program is free software: you can redistribute it and/or modify\n\
+    it under the terms of the GNU Lesser General Public License as\n\
+    published by the Free Software Foundation, either version 3 of the\n\
+    License, or (at your option) any later version.\n\
+\n\
+    This program is distributed in the hope that it will be useful,\n\
+    but WITHOUT ANY WARRANTY; without even the implied warranty of\n\
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the\n\
+    GNU Lesser General Public License for more details.\n\
+\n\
+    You should have received a copy of the GNU Lesser General Public\n\
+    License along with this program.\n\
+    If not, see <http://www.gnu.org/licenses/>.\n\
+ */\n\
+\n\
+");
+}
+
+/* The serialization primitives all generated writers are built on */
+void print_primitives() {
+  printf("extern const char *tlsrpt_json_escape_values[256];\n\
+extern const unsigned char tlsrpt_json_escape_lengths[256];\n\
+\n\
+/* Bytes needed to format any int */\n\
+#define TLSRPT_INT_MAX_SIZE 11\n\
+\n\
+/* Writes the first length bytes of a value JSON-escaped, runs of bytes that need no escaping are written at once */\n\
+static inline int tlsrpt_json_escape(FILE* file, const char* s, size_t length) {\n\
+  const unsigned char *run=(const unsigned char*)s;\n\
+  const unsigned char *end=run+length;\n\
+  for(const unsigned char *c=run; c<end; ++c) {\n\
+    if(tlsrpt_json_escape_lengths[*c]==1) continue;\n\
+    if(c>run && fwrite(run, 1, c-run, file)!=(size_t)(c-run)) return -1;\n\
+    if(fputs(tlsrpt_json_escape_values[*c], file)<0) return -1;\n\
+    run=c+1;\n\
+  }\n\
+  if(end>run && fwrite(run, 1, end-run, file)!=(size_t)(end-run)) return -1;\n\
+  return 0;\n\
+}\n\
+\n\
+/* Returns the size of the first length bytes of a value after JSON-escaping */\n\
+static inline size_t tlsrpt_json_escaped_size(const char* s, size_t length) {\n\
+  size_t size=0;\n\
+  for(size_t i=0; i<length; ++i) size+=tlsrpt_json_escape_lengths[(unsigned char)s[i]];\n\
+  return size;\n\
+}\n\
+\n\
+/* Formats an int into a buffer of at least TLSRPT_INT_MAX_SIZE bytes, returns the number of bytes used */\n\
+static inline size_t tlsrpt_format_int(char* buffer, int value) {\n\
+  char digits[TLSRPT_INT_MAX_SIZE];\n\
+  unsigned int u=(value<0)?0u-(unsigned int)value:(unsigned int)value;\n\
+  size_t n=0;\n\
+  do {\n\
+    digits[n++]=(char)('0'+u%%10);\n\
+    u/=10;\n\
+  } while(u>0);\n\
+  size_t size=0;\n\
+  if(value<0) buffer[size++]='-';\n\
+  while(n>0) buffer[size++]=digits[--n];\n\
+  return size;\n\
+}\n\
+\n\
+/* Returns the number of bytes an int is formatted to */\n\
+static inline size_t tlsrpt_int_size(int value) {\n\
+  char buffer[TLSRPT_INT_MAX_SIZE];\n\
+  return tlsrpt_format_int(buffer, value);\n\
+}\n\
+\n\
+static inline int tlsrpt_serialize_constant(FILE* file, const char* s, size_t size) {\n\
+  return (fwrite(s, 1, size, file)==size)?0:-1;\n\
+}\n\
+\n\
+/* Writes a string literal, its size is known at compile time */\n\
+#define TLSRPT_SERIALIZE_LITERAL(file, s) tlsrpt_serialize_constant(file, s, sizeof(s)-1)\n\
+\n\
+static inline int tlsrpt_serialize_int(FILE* file, const char* prefix, size_t prefixsize, int value) {\n\
+  char buffer[TLSRPT_INT_MAX_SIZE];\n\
+  size_t size=tlsrpt_format_int(buffer, value);\n\
+  if(fwrite(prefix, 1, prefixsize, file)!=prefixsize) return -1;\n\
+  return (fwrite(buffer, 1, size, file)==size)?0:-1;\n\
+}\n\
+\n\
+static inline int tlsrpt_serialize_string(FILE* file, const char* prefix, size_t prefixsize, const char* value, size_t length) {\n\
+  if(fwrite(prefix, 1, prefixsize, file)!=prefixsize) return -1;\n\
+  if(tlsrpt_json_escape(file, value, length)<0) return -1;\n\
+  return (fputc('\"', file)==EOF)?-1:0;\n\
+}\n\
+\n\
+/* The closing quote of a string value */\n\
+#define TLSRPT_STRING_END \"\\\"\"\n\
+\n\
+/* Objects and items of lists, the first item is written without a leading \",\" separator */\n\
+#define TLSRPT_STRING_ITEM_FIRST \"\\\"\"\n\
+#define TLSRPT_STRING_ITEM \",\\\"\"\n\
+#define TLSRPT_OBJECT_BEGIN \"{\"\n\
+#define TLSRPT_OBJECT_ITEM \",{\"\n\
+#define TLSRPT_OBJECT_END \"}\"\n\
+#define TLSRPT_LIST_END \"]\"\n\
+\n\
+");
+}
+
+/* Prints the name of a field in upper case for the generated macros */
+void print_upper(const char* name) {
+  for(const char* c=name; *c; ++c) putchar(toupper((unsigned char)*c));
+}
+
+/* Prints the C string literal of the constant prefix written before the value of a field */
+void print_prefix(const field_t* f) {
+  printf("\"%s\\\"%s\\\":", f->first?"":",", f->key);
+  if(f->type==STRING) printf(" \\\"");
+  if(f->type==STRINGS || f->type==OBJECTS) printf("[");
+  printf("\"");
+}
+
+void print_field(const field_t* f) {
+  static const char* types[]={"string", "int", "list of strings", "list of objects"};
+  printf("/* %s: %s, %s in a %s */\n", f->key, f->description, types[f->type], f->object);
+  printf("#define TLSRPT_KEY_"); print_upper(f->name); printf(" "); print_prefix(f); printf("\n");
+  printf("#define TLSRPT_KEY_"); print_upper(f->name); printf("_SIZE (sizeof(TLSRPT_KEY_"); print_upper(f->name); printf(")-1)\n");
+  switch(f->type) {
+  case STRING:
+    printf("static inline int tlsrpt_serialize_%s(FILE* file, const char* value, size_t length) {\n", f->name);
+    printf("  return tlsrpt_serialize_string(file, TLSRPT_KEY_"); print_upper(f->name); printf(", TLSRPT_KEY_"); print_upper(f->name); printf("_SIZE, value, length);\n}\n");
+    printf("static inline size_t tlsrpt_size_%s(const char* value, size_t length) {\n", f->name);
+    printf("  return TLSRPT_KEY_"); print_upper(f->name); printf("_SIZE+tlsrpt_json_escaped_size(value, length)+1;\n}\n");
+    break;
+  case INT:
+    printf("#define TLSRPT_MAX_SIZE_"); print_upper(f->name); printf(" (TLSRPT_KEY_"); print_upper(f->name); printf("_SIZE+TLSRPT_INT_MAX_SIZE)\n");
+    printf("static inline int tlsrpt_serialize_%s(FILE* file, int value) {\n", f->name);
+    printf("  return tlsrpt_serialize_int(file, TLSRPT_KEY_"); print_upper(f->name); printf(", TLSRPT_KEY_"); print_upper(f->name); printf("_SIZE, value);\n}\n");
+    printf("static inline size_t tlsrpt_size_%s(int value) {\n", f->name);
+    printf("  return TLSRPT_KEY_"); print_upper(f->name); printf("_SIZE+tlsrpt_int_size(value);\n}\n");
+    break;
+  case STRINGS:
+  case OBJECTS:
+    printf("/* size of the empty list including the closing bracket */\n");
+    printf("#define TLSRPT_SIZE_"); print_upper(f->name); printf(" (TLSRPT_KEY_"); print_upper(f->name); printf("_SIZE+1)\n");
+    printf("static inline int tlsrpt_serialize_%s_begin(FILE* file) {\n", f->name);
+    printf("  return tlsrpt_serialize_constant(file, TLSRPT_KEY_"); print_upper(f->name); printf(", TLSRPT_KEY_"); print_upper(f->name); printf("_SIZE);\n}\n");
+    if(f->type==STRINGS) {
+      printf("static inline int tlsrpt_serialize_%s_item(FILE* file, int first, const char* value, size_t length) {\n", f->name);
+      printf("  return first ? tlsrpt_serialize_string(file, TLSRPT_STRING_ITEM_FIRST, 1, value, length) : tlsrpt_serialize_string(file, TLSRPT_STRING_ITEM, 2, value, length);\n}\n");
+      printf("static inline size_t tlsrpt_size_%s_item(int first, const char* value, size_t length) {\n", f->name);
+      printf("  return (first?1:2)+tlsrpt_json_escaped_size(value, length)+1;\n}\n");
+    }
+    break;
+  }
+  printf("\n");
+}
+
+/* Prints a constant attribute, returns -1 if its field is not a STRING or INT field of the schema */
+int print_constant(const constant_t* c) {
+  const field_t* f=NULL;
+  for(int i=0; i<SCHEMA_FIELDS; ++i) if(strcmp(schema[i].name, c->field)==0) f=&schema[i];
+  if(f==NULL || (f->type!=STRING && f->type!=INT) || (f->type==STRING)!=(c->string!=NULL)) {
+    fprintf(stderr, "constant %s: invalid field %s\n", c->name, c->field);
+    return -1;
+  }
+  if(f->type==STRING) {
+    printf("/* %s: \"%s\" in a %s */\n", f->key, c->string, c->description);
+    printf("#define TLSRPT_ATTR_"); print_upper(c->name); printf(" TLSRPT_KEY_"); print_upper(f->name); printf(" \"%s\" TLSRPT_STRING_END\n", c->string);
+  } else {
+    printf("/* %s: %d in a %s */\n", f->key, c->value, c->description);
+    printf("#define TLSRPT_ATTR_"); print_upper(c->name); printf(" TLSRPT_KEY_"); print_upper(f->name); printf(" \"%d\"\n", c->value);
+  }
+  return 0;
+}
+
+int main(void) {
+  print_license();
+  printf("/* Generated by create-datagram-serializer.c from the datagram schema, do not edit */\n\n");
+  printf("#ifndef DATAGRAM_SERIALIZER_H\n#define DATAGRAM_SERIALIZER_H\n\n");
+  printf("#include <stdio.h>\n#include <string.h>\n\n");
+
+  printf("/* Index of json keys\n\n");
+  for(int i=0; i<SCHEMA_FIELDS; ++i) printf("%s : %s, %s\n", schema[i].key, schema[i].object, schema[i].description);
+  printf("*/\n\n");
+
+  print_primitives();
+  for(int i=0; i<SCHEMA_FIELDS; ++i) print_field(&schema[i]);
+
+  printf("/* Attributes with a fixed value */\n");
+  for(int i=0; i<CONSTANTS; ++i) {
+    if(print_constant(&constants[i])<0) return 1;
+  }
+  printf("\n");
+
+  /* the failure detail string fields are addressed by their tlsrpt_failure_field_t */
+  const field_t* failurefields[FAILURE_FIELDS]={0};
+  for(int i=0; i<SCHEMA_FIELDS; ++i) if(schema[i].failurefield>0) failurefields[schema[i].failurefield-1]=&schema[i];
+  printf("/* Key prefixes of the failure detail string fields, in the order of tlsrpt_failure_field_t */\n");
+  printf("static const char* const tlsrpt_failure_field_prefixes[%d]={", FAILURE_FIELDS);
+  for(int i=0; i<FAILURE_FIELDS; ++i) {
+    printf("%sTLSRPT_KEY_", (i==0)?"":", ");
+    print_upper(failurefields[i]->name);
+  }
+  printf("};\n");
+  printf("static const size_t tlsrpt_failure_field_prefix_sizes[%d]={", FAILURE_FIELDS);
+  for(int i=0; i<FAILURE_FIELDS; ++i) {
+    printf("%sTLSRPT_KEY_", (i==0)?"":", ");
+    print_upper(failurefields[i]->name);
+    printf("_SIZE");
+  }
+  printf("};\n\n");
+
+  printf("#endif /* DATAGRAM_SERIALIZER_H */\n");
+  return 0;
+}
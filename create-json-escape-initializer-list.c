@@ -45,6 +45,7 @@ void print_license() {
 int main(void) {
   print_license();
   const char* sep="const char *tlsrpt_json_escape_values[256]={\n";
+  unsigned char lengths[256];
   for(int i=0; i<256; ++i) {
     if(((unsigned char)i)=='\b') printf("%s \"\\\\b\"",sep);
     else if(((unsigned char)i)=='\f') printf("%s \"\\\\f\"",sep);
@@ -56,8 +57,20 @@ int main(void) {
     else if(i==127 || i<32) printf("%s \"\\\\u%04x\"",sep,i);
     else if(i>127) printf("%s \"\\x%02x\"",sep,i);
     else printf("%s \"%c\"",sep,i);
+    if(i=='\b' || i=='\f' || i=='\n' || i=='\r' || i=='\t' || i=='\\' || i=='"') lengths[i]=2;
+    else if(i==127 || i<32) lengths[i]=6;
+    else lengths[i]=1;
     if(i%8==7) sep=",\n";
     else sep=",";
   }
   printf("};\n");
+
+  /* lengths of the escaped values, so that runs of unescaped bytes can be written at once and sizes computed without writing */
+  sep="\nconst unsigned char tlsrpt_json_escape_lengths[256]={\n";
+  for(int i=0; i<256; ++i) {
+    printf("%s %d",sep,lengths[i]);
+    if(i%16==15) sep=",\n";
+    else sep=",";
+  }
+  printf("};\n");
 }
@@ -0,0 +1,397 @@
+/*
+    Copyright (C) 2024-2025 sys4 AG
+    Author Boris Lohner bl@sys4.de
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this program.
+    If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Generated by create-datagram-serializer.c from the datagram schema, do not edit */
+
+#ifndef DATAGRAM_SERIALIZER_H
+#define DATAGRAM_SERIALIZER_H
+
+#include <stdio.h>
+#include <string.h>
+
+/* Index of json keys
+
+dpv : delivery request, version of the datagram protocol, "1" for a single delivery request, "2" for a batch
+d : delivery request, recipient domain
+pr : delivery request, TLSRPT policy record of the recipient domain
+policies : delivery request, the policies of the delivery request
+dp : delivery request, number of policies dropped by the policies limit, only present if policies were dropped
+dt : delivery request, total failure count of the dropped policies, only present if policies were dropped
+tr : delivery request or policy, 1 if details of the policy or delivery request were dropped or cut by a limit, only present if truncated
+b : batch, the delivery requests of a batch datagram
+policy-type : policy, tlsrpt_policy_type_t of the policy
+policy-domain : policy, policy domain, only present if given
+policy-string : policy, policy strings, only present if any were added
+mx-host : policy, mx host patterns, only present if any were added
+failure-details : policy, distinct failure details, only present if any were added
+t : policy, total number of failures of the policy
+f : policy, tlsrpt_final_result_t of the policy
+c : failure detail, failure_details.failure_code
+s : failure detail, failure_details.sending_mta_ip
+n : failure detail, failure_details.receiving_mx_hostname
+h : failure detail, failure_details.receiving_mx_helo
+r : failure detail, failure_details.receiving_ip
+a : failure detail, failure_details.additional_information
+f : failure detail, failure_details.failure_reason_code
+k : failure detail, failure_details.failed-session-count, only present if an identical failure was added more than once
+*/
+
+extern const char *tlsrpt_json_escape_values[256];
+extern const unsigned char tlsrpt_json_escape_lengths[256];
+
+/* Bytes needed to format any int */
+#define TLSRPT_INT_MAX_SIZE 11
+
+/* Writes the first length bytes of a value JSON-escaped, runs of bytes that need no escaping are written at once */
+static inline int tlsrpt_json_escape(FILE* file, const char* s, size_t length) {
+  const unsigned char *run=(const unsigned char*)s;
+  const unsigned char *end=run+length;
+  for(const unsigned char *c=run; c<end; ++c) {
+    if(tlsrpt_json_escape_lengths[*c]==1) continue;
+    if(c>run && fwrite(run, 1, c-run, file)!=(size_t)(c-run)) return -1;
+    if(fputs(tlsrpt_json_escape_values[*c], file)<0) return -1;
+    run=c+1;
+  }
+  if(end>run && fwrite(run, 1, end-run, file)!=(size_t)(end-run)) return -1;
+  return 0;
+}
+
+/* Returns the size of the first length bytes of a value after JSON-escaping */
+static inline size_t tlsrpt_json_escaped_size(const char* s, size_t length) {
+  size_t size=0;
+  for(size_t i=0; i<length; ++i) size+=tlsrpt_json_escape_lengths[(unsigned char)s[i]];
+  return size;
+}
+
+/* Formats an int into a buffer of at least TLSRPT_INT_MAX_SIZE bytes, returns the number of bytes used */
+static inline size_t tlsrpt_format_int(char* buffer, int value) {
+  char digits[TLSRPT_INT_MAX_SIZE];
+  unsigned int u=(value<0)?0u-(unsigned int)value:(unsigned int)value;
+  size_t n=0;
+  do {
+    digits[n++]=(char)('0'+u%10);
+    u/=10;
+  } while(u>0);
+  size_t size=0;
+  if(value<0) buffer[size++]='-';
+  while(n>0) buffer[size++]=digits[--n];
+  return size;
+}
+
+/* Returns the number of bytes an int is formatted to */
+static inline size_t tlsrpt_int_size(int value) {
+  char buffer[TLSRPT_INT_MAX_SIZE];
+  return tlsrpt_format_int(buffer, value);
+}
+
+static inline int tlsrpt_serialize_constant(FILE* file, const char* s, size_t size) {
+  return (fwrite(s, 1, size, file)==size)?0:-1;
+}
+
+/* Writes a string literal, its size is known at compile time */
+#define TLSRPT_SERIALIZE_LITERAL(file, s) tlsrpt_serialize_constant(file, s, sizeof(s)-1)
+
+static inline int tlsrpt_serialize_int(FILE* file, const char* prefix, size_t prefixsize, int value) {
+  char buffer[TLSRPT_INT_MAX_SIZE];
+  size_t size=tlsrpt_format_int(buffer, value);
+  if(fwrite(prefix, 1, prefixsize, file)!=prefixsize) return -1;
+  return (fwrite(buffer, 1, size, file)==size)?0:-1;
+}
+
+static inline int tlsrpt_serialize_string(FILE* file, const char* prefix, size_t prefixsize, const char* value, size_t length) {
+  if(fwrite(prefix, 1, prefixsize, file)!=prefixsize) return -1;
+  if(tlsrpt_json_escape(file, value, length)<0) return -1;
+  return (fputc('"', file)==EOF)?-1:0;
+}
+
+/* The closing quote of a string value */
+#define TLSRPT_STRING_END "\""
+
+/* Objects and items of lists, the first item is written without a leading "," separator */
+#define TLSRPT_STRING_ITEM_FIRST "\""
+#define TLSRPT_STRING_ITEM ",\""
+#define TLSRPT_OBJECT_BEGIN "{"
+#define TLSRPT_OBJECT_ITEM ",{"
+#define TLSRPT_OBJECT_END "}"
+#define TLSRPT_LIST_END "]"
+
+/* dpv: version of the datagram protocol, "1" for a single delivery request, "2" for a batch, string in a delivery request */
+#define TLSRPT_KEY_DATAGRAM_PROTOCOL_VERSION "\"dpv\": \""
+#define TLSRPT_KEY_DATAGRAM_PROTOCOL_VERSION_SIZE (sizeof(TLSRPT_KEY_DATAGRAM_PROTOCOL_VERSION)-1)
+static inline int tlsrpt_serialize_datagram_protocol_version(FILE* file, const char* value, size_t length) {
+  return tlsrpt_serialize_string(file, TLSRPT_KEY_DATAGRAM_PROTOCOL_VERSION, TLSRPT_KEY_DATAGRAM_PROTOCOL_VERSION_SIZE, value, length);
+}
+static inline size_t tlsrpt_size_datagram_protocol_version(const char* value, size_t length) {
+  return TLSRPT_KEY_DATAGRAM_PROTOCOL_VERSION_SIZE+tlsrpt_json_escaped_size(value, length)+1;
+}
+
+/* d: recipient domain, string in a delivery request */
+#define TLSRPT_KEY_DOMAIN ",\"d\": \""
+#define TLSRPT_KEY_DOMAIN_SIZE (sizeof(TLSRPT_KEY_DOMAIN)-1)
+static inline int tlsrpt_serialize_domain(FILE* file, const char* value, size_t length) {
+  return tlsrpt_serialize_string(file, TLSRPT_KEY_DOMAIN, TLSRPT_KEY_DOMAIN_SIZE, value, length);
+}
+static inline size_t tlsrpt_size_domain(const char* value, size_t length) {
+  return TLSRPT_KEY_DOMAIN_SIZE+tlsrpt_json_escaped_size(value, length)+1;
+}
+
+/* pr: TLSRPT policy record of the recipient domain, string in a delivery request */
+#define TLSRPT_KEY_POLICY_RECORD ",\"pr\": \""
+#define TLSRPT_KEY_POLICY_RECORD_SIZE (sizeof(TLSRPT_KEY_POLICY_RECORD)-1)
+static inline int tlsrpt_serialize_policy_record(FILE* file, const char* value, size_t length) {
+  return tlsrpt_serialize_string(file, TLSRPT_KEY_POLICY_RECORD, TLSRPT_KEY_POLICY_RECORD_SIZE, value, length);
+}
+static inline size_t tlsrpt_size_policy_record(const char* value, size_t length) {
+  return TLSRPT_KEY_POLICY_RECORD_SIZE+tlsrpt_json_escaped_size(value, length)+1;
+}
+
+/* policies: the policies of the delivery request, list of objects in a delivery request */
+#define TLSRPT_KEY_POLICIES ",\"policies\":["
+#define TLSRPT_KEY_POLICIES_SIZE (sizeof(TLSRPT_KEY_POLICIES)-1)
+/* size of the empty list including the closing bracket */
+#define TLSRPT_SIZE_POLICIES (TLSRPT_KEY_POLICIES_SIZE+1)
+static inline int tlsrpt_serialize_policies_begin(FILE* file) {
+  return tlsrpt_serialize_constant(file, TLSRPT_KEY_POLICIES, TLSRPT_KEY_POLICIES_SIZE);
+}
+
+/* dp: number of policies dropped by the policies limit, only present if policies were dropped, int in a delivery request */
+#define TLSRPT_KEY_DROPPED_POLICIES ",\"dp\":"
+#define TLSRPT_KEY_DROPPED_POLICIES_SIZE (sizeof(TLSRPT_KEY_DROPPED_POLICIES)-1)
+#define TLSRPT_MAX_SIZE_DROPPED_POLICIES (TLSRPT_KEY_DROPPED_POLICIES_SIZE+TLSRPT_INT_MAX_SIZE)
+static inline int tlsrpt_serialize_dropped_policies(FILE* file, int value) {
+  return tlsrpt_serialize_int(file, TLSRPT_KEY_DROPPED_POLICIES, TLSRPT_KEY_DROPPED_POLICIES_SIZE, value);
+}
+static inline size_t tlsrpt_size_dropped_policies(int value) {
+  return TLSRPT_KEY_DROPPED_POLICIES_SIZE+tlsrpt_int_size(value);
+}
+
+/* dt: total failure count of the dropped policies, only present if policies were dropped, int in a delivery request */
+#define TLSRPT_KEY_DROPPED_FAILURES ",\"dt\":"
+#define TLSRPT_KEY_DROPPED_FAILURES_SIZE (sizeof(TLSRPT_KEY_DROPPED_FAILURES)-1)
+#define TLSRPT_MAX_SIZE_DROPPED_FAILURES (TLSRPT_KEY_DROPPED_FAILURES_SIZE+TLSRPT_INT_MAX_SIZE)
+static inline int tlsrpt_serialize_dropped_failures(FILE* file, int value) {
+  return tlsrpt_serialize_int(file, TLSRPT_KEY_DROPPED_FAILURES, TLSRPT_KEY_DROPPED_FAILURES_SIZE, value);
+}
+static inline size_t tlsrpt_size_dropped_failures(int value) {
+  return TLSRPT_KEY_DROPPED_FAILURES_SIZE+tlsrpt_int_size(value);
+}
+
+/* tr: 1 if details of the policy or delivery request were dropped or cut by a limit, only present if truncated, int in a delivery request or policy */
+#define TLSRPT_KEY_TRUNCATED ",\"tr\":"
+#define TLSRPT_KEY_TRUNCATED_SIZE (sizeof(TLSRPT_KEY_TRUNCATED)-1)
+#define TLSRPT_MAX_SIZE_TRUNCATED (TLSRPT_KEY_TRUNCATED_SIZE+TLSRPT_INT_MAX_SIZE)
+static inline int tlsrpt_serialize_truncated(FILE* file, int value) {
+  return tlsrpt_serialize_int(file, TLSRPT_KEY_TRUNCATED, TLSRPT_KEY_TRUNCATED_SIZE, value);
+}
+static inline size_t tlsrpt_size_truncated(int value) {
+  return TLSRPT_KEY_TRUNCATED_SIZE+tlsrpt_int_size(value);
+}
+
+/* b: the delivery requests of a batch datagram, list of objects in a batch */
+#define TLSRPT_KEY_BATCH ",\"b\":["
+#define TLSRPT_KEY_BATCH_SIZE (sizeof(TLSRPT_KEY_BATCH)-1)
+/* size of the empty list including the closing bracket */
+#define TLSRPT_SIZE_BATCH (TLSRPT_KEY_BATCH_SIZE+1)
+static inline int tlsrpt_serialize_batch_begin(FILE* file) {
+  return tlsrpt_serialize_constant(file, TLSRPT_KEY_BATCH, TLSRPT_KEY_BATCH_SIZE);
+}
+
+/* policy-type: tlsrpt_policy_type_t of the policy, int in a policy */
+#define TLSRPT_KEY_POLICY_TYPE "\"policy-type\":"
+#define TLSRPT_KEY_POLICY_TYPE_SIZE (sizeof(TLSRPT_KEY_POLICY_TYPE)-1)
+#define TLSRPT_MAX_SIZE_POLICY_TYPE (TLSRPT_KEY_POLICY_TYPE_SIZE+TLSRPT_INT_MAX_SIZE)
+static inline int tlsrpt_serialize_policy_type(FILE* file, int value) {
+  return tlsrpt_serialize_int(file, TLSRPT_KEY_POLICY_TYPE, TLSRPT_KEY_POLICY_TYPE_SIZE, value);
+}
+static inline size_t tlsrpt_size_policy_type(int value) {
+  return TLSRPT_KEY_POLICY_TYPE_SIZE+tlsrpt_int_size(value);
+}
+
+/* policy-domain: policy domain, only present if given, string in a policy */
+#define TLSRPT_KEY_POLICY_DOMAIN ",\"policy-domain\": \""
+#define TLSRPT_KEY_POLICY_DOMAIN_SIZE (sizeof(TLSRPT_KEY_POLICY_DOMAIN)-1)
+static inline int tlsrpt_serialize_policy_domain(FILE* file, const char* value, size_t length) {
+  return tlsrpt_serialize_string(file, TLSRPT_KEY_POLICY_DOMAIN, TLSRPT_KEY_POLICY_DOMAIN_SIZE, value, length);
+}
+static inline size_t tlsrpt_size_policy_domain(const char* value, size_t length) {
+  return TLSRPT_KEY_POLICY_DOMAIN_SIZE+tlsrpt_json_escaped_size(value, length)+1;
+}
+
+/* policy-string: policy strings, only present if any were added, list of strings in a policy */
+#define TLSRPT_KEY_POLICY_STRINGS ",\"policy-string\":["
+#define TLSRPT_KEY_POLICY_STRINGS_SIZE (sizeof(TLSRPT_KEY_POLICY_STRINGS)-1)
+/* size of the empty list including the closing bracket */
+#define TLSRPT_SIZE_POLICY_STRINGS (TLSRPT_KEY_POLICY_STRINGS_SIZE+1)
+static inline int tlsrpt_serialize_policy_strings_begin(FILE* file) {
+  return tlsrpt_serialize_constant(file, TLSRPT_KEY_POLICY_STRINGS, TLSRPT_KEY_POLICY_STRINGS_SIZE);
+}
+static inline int tlsrpt_serialize_policy_strings_item(FILE* file, int first, const char* value, size_t length) {
+  return first ? tlsrpt_serialize_string(file, TLSRPT_STRING_ITEM_FIRST, 1, value, length) : tlsrpt_serialize_string(file, TLSRPT_STRING_ITEM, 2, value, length);
+}
+static inline size_t tlsrpt_size_policy_strings_item(int first, const char* value, size_t length) {
+  return (first?1:2)+tlsrpt_json_escaped_size(value, length)+1;
+}
+
+/* mx-host: mx host patterns, only present if any were added, list of strings in a policy */
+#define TLSRPT_KEY_MX_HOSTS ",\"mx-host\":["
+#define TLSRPT_KEY_MX_HOSTS_SIZE (sizeof(TLSRPT_KEY_MX_HOSTS)-1)
+/* size of the empty list including the closing bracket */
+#define TLSRPT_SIZE_MX_HOSTS (TLSRPT_KEY_MX_HOSTS_SIZE+1)
+static inline int tlsrpt_serialize_mx_hosts_begin(FILE* file) {
+  return tlsrpt_serialize_constant(file, TLSRPT_KEY_MX_HOSTS, TLSRPT_KEY_MX_HOSTS_SIZE);
+}
+static inline int tlsrpt_serialize_mx_hosts_item(FILE* file, int first, const char* value, size_t length) {
+  return first ? tlsrpt_serialize_string(file, TLSRPT_STRING_ITEM_FIRST, 1, value, length) : tlsrpt_serialize_string(file, TLSRPT_STRING_ITEM, 2, value, length);
+}
+static inline size_t tlsrpt_size_mx_hosts_item(int first, const char* value, size_t length) {
+  return (first?1:2)+tlsrpt_json_escaped_size(value, length)+1;
+}
+
+/* failure-details: distinct failure details, only present if any were added, list of objects in a policy */
+#define TLSRPT_KEY_FAILURE_DETAILS ",\"failure-details\":["
+#define TLSRPT_KEY_FAILURE_DETAILS_SIZE (sizeof(TLSRPT_KEY_FAILURE_DETAILS)-1)
+/* size of the empty list including the closing bracket */
+#define TLSRPT_SIZE_FAILURE_DETAILS (TLSRPT_KEY_FAILURE_DETAILS_SIZE+1)
+static inline int tlsrpt_serialize_failure_details_begin(FILE* file) {
+  return tlsrpt_serialize_constant(file, TLSRPT_KEY_FAILURE_DETAILS, TLSRPT_KEY_FAILURE_DETAILS_SIZE);
+}
+
+/* t: total number of failures of the policy, int in a policy */
+#define TLSRPT_KEY_FAILURE_COUNT ",\"t\":"
+#define TLSRPT_KEY_FAILURE_COUNT_SIZE (sizeof(TLSRPT_KEY_FAILURE_COUNT)-1)
+#define TLSRPT_MAX_SIZE_FAILURE_COUNT (TLSRPT_KEY_FAILURE_COUNT_SIZE+TLSRPT_INT_MAX_SIZE)
+static inline int tlsrpt_serialize_failure_count(FILE* file, int value) {
+  return tlsrpt_serialize_int(file, TLSRPT_KEY_FAILURE_COUNT, TLSRPT_KEY_FAILURE_COUNT_SIZE, value);
+}
+static inline size_t tlsrpt_size_failure_count(int value) {
+  return TLSRPT_KEY_FAILURE_COUNT_SIZE+tlsrpt_int_size(value);
+}
+
+/* f: tlsrpt_final_result_t of the policy, int in a policy */
+#define TLSRPT_KEY_FINAL_RESULT ",\"f\":"
+#define TLSRPT_KEY_FINAL_RESULT_SIZE (sizeof(TLSRPT_KEY_FINAL_RESULT)-1)
+#define TLSRPT_MAX_SIZE_FINAL_RESULT (TLSRPT_KEY_FINAL_RESULT_SIZE+TLSRPT_INT_MAX_SIZE)
+static inline int tlsrpt_serialize_final_result(FILE* file, int value) {
+  return tlsrpt_serialize_int(file, TLSRPT_KEY_FINAL_RESULT, TLSRPT_KEY_FINAL_RESULT_SIZE, value);
+}
+static inline size_t tlsrpt_size_final_result(int value) {
+  return TLSRPT_KEY_FINAL_RESULT_SIZE+tlsrpt_int_size(value);
+}
+
+/* c: failure_details.failure_code, int in a failure detail */
+#define TLSRPT_KEY_FAILURE_CODE "\"c\":"
+#define TLSRPT_KEY_FAILURE_CODE_SIZE (sizeof(TLSRPT_KEY_FAILURE_CODE)-1)
+#define TLSRPT_MAX_SIZE_FAILURE_CODE (TLSRPT_KEY_FAILURE_CODE_SIZE+TLSRPT_INT_MAX_SIZE)
+static inline int tlsrpt_serialize_failure_code(FILE* file, int value) {
+  return tlsrpt_serialize_int(file, TLSRPT_KEY_FAILURE_CODE, TLSRPT_KEY_FAILURE_CODE_SIZE, value);
+}
+static inline size_t tlsrpt_size_failure_code(int value) {
+  return TLSRPT_KEY_FAILURE_CODE_SIZE+tlsrpt_int_size(value);
+}
+
+/* s: failure_details.sending_mta_ip, string in a failure detail */
+#define TLSRPT_KEY_SENDING_MTA_IP ",\"s\": \""
+#define TLSRPT_KEY_SENDING_MTA_IP_SIZE (sizeof(TLSRPT_KEY_SENDING_MTA_IP)-1)
+static inline int tlsrpt_serialize_sending_mta_ip(FILE* file, const char* value, size_t length) {
+  return tlsrpt_serialize_string(file, TLSRPT_KEY_SENDING_MTA_IP, TLSRPT_KEY_SENDING_MTA_IP_SIZE, value, length);
+}
+static inline size_t tlsrpt_size_sending_mta_ip(const char* value, size_t length) {
+  return TLSRPT_KEY_SENDING_MTA_IP_SIZE+tlsrpt_json_escaped_size(value, length)+1;
+}
+
+/* n: failure_details.receiving_mx_hostname, string in a failure detail */
+#define TLSRPT_KEY_RECEIVING_MX_HOSTNAME ",\"n\": \""
+#define TLSRPT_KEY_RECEIVING_MX_HOSTNAME_SIZE (sizeof(TLSRPT_KEY_RECEIVING_MX_HOSTNAME)-1)
+static inline int tlsrpt_serialize_receiving_mx_hostname(FILE* file, const char* value, size_t length) {
+  return tlsrpt_serialize_string(file, TLSRPT_KEY_RECEIVING_MX_HOSTNAME, TLSRPT_KEY_RECEIVING_MX_HOSTNAME_SIZE, value, length);
+}
+static inline size_t tlsrpt_size_receiving_mx_hostname(const char* value, size_t length) {
+  return TLSRPT_KEY_RECEIVING_MX_HOSTNAME_SIZE+tlsrpt_json_escaped_size(value, length)+1;
+}
+
+/* h: failure_details.receiving_mx_helo, string in a failure detail */
+#define TLSRPT_KEY_RECEIVING_MX_HELO ",\"h\": \""
+#define TLSRPT_KEY_RECEIVING_MX_HELO_SIZE (sizeof(TLSRPT_KEY_RECEIVING_MX_HELO)-1)
+static inline int tlsrpt_serialize_receiving_mx_helo(FILE* file, const char* value, size_t length) {
+  return tlsrpt_serialize_string(file, TLSRPT_KEY_RECEIVING_MX_HELO, TLSRPT_KEY_RECEIVING_MX_HELO_SIZE, value, length);
+}
+static inline size_t tlsrpt_size_receiving_mx_helo(const char* value, size_t length) {
+  return TLSRPT_KEY_RECEIVING_MX_HELO_SIZE+tlsrpt_json_escaped_size(value, length)+1;
+}
+
+/* r: failure_details.receiving_ip, string in a failure detail */
+#define TLSRPT_KEY_RECEIVING_IP ",\"r\": \""
+#define TLSRPT_KEY_RECEIVING_IP_SIZE (sizeof(TLSRPT_KEY_RECEIVING_IP)-1)
+static inline int tlsrpt_serialize_receiving_ip(FILE* file, const char* value, size_t length) {
+  return tlsrpt_serialize_string(file, TLSRPT_KEY_RECEIVING_IP, TLSRPT_KEY_RECEIVING_IP_SIZE, value, length);
+}
+static inline size_t tlsrpt_size_receiving_ip(const char* value, size_t length) {
+  return TLSRPT_KEY_RECEIVING_IP_SIZE+tlsrpt_json_escaped_size(value, length)+1;
+}
+
+/* a: failure_details.additional_information, string in a failure detail */
+#define TLSRPT_KEY_ADDITIONAL_INFORMATION ",\"a\": \""
+#define TLSRPT_KEY_ADDITIONAL_INFORMATION_SIZE (sizeof(TLSRPT_KEY_ADDITIONAL_INFORMATION)-1)
+static inline int tlsrpt_serialize_additional_information(FILE* file, const char* value, size_t length) {
+  return tlsrpt_serialize_string(file, TLSRPT_KEY_ADDITIONAL_INFORMATION, TLSRPT_KEY_ADDITIONAL_INFORMATION_SIZE, value, length);
+}
+static inline size_t tlsrpt_size_additional_information(const char* value, size_t length) {
+  return TLSRPT_KEY_ADDITIONAL_INFORMATION_SIZE+tlsrpt_json_escaped_size(value, length)+1;
+}
+
+/* f: failure_details.failure_reason_code, string in a failure detail */
+#define TLSRPT_KEY_FAILURE_REASON_CODE ",\"f\": \""
+#define TLSRPT_KEY_FAILURE_REASON_CODE_SIZE (sizeof(TLSRPT_KEY_FAILURE_REASON_CODE)-1)
+static inline int tlsrpt_serialize_failure_reason_code(FILE* file, const char* value, size_t length) {
+  return tlsrpt_serialize_string(file, TLSRPT_KEY_FAILURE_REASON_CODE, TLSRPT_KEY_FAILURE_REASON_CODE_SIZE, value, length);
+}
+static inline size_t tlsrpt_size_failure_reason_code(const char* value, size_t length) {
+  return TLSRPT_KEY_FAILURE_REASON_CODE_SIZE+tlsrpt_json_escaped_size(value, length)+1;
+}
+
+/* k: failure_details.failed-session-count, only present if an identical failure was added more than once, int in a failure detail */
+#define TLSRPT_KEY_FAILED_SESSION_COUNT ",\"k\":"
+#define TLSRPT_KEY_FAILED_SESSION_COUNT_SIZE (sizeof(TLSRPT_KEY_FAILED_SESSION_COUNT)-1)
+#define TLSRPT_MAX_SIZE_FAILED_SESSION_COUNT (TLSRPT_KEY_FAILED_SESSION_COUNT_SIZE+TLSRPT_INT_MAX_SIZE)
+static inline int tlsrpt_serialize_failed_session_count(FILE* file, int value) {
+  return tlsrpt_serialize_int(file, TLSRPT_KEY_FAILED_SESSION_COUNT, TLSRPT_KEY_FAILED_SESSION_COUNT_SIZE, value);
+}
+static inline size_t tlsrpt_size_failed_session_count(int value) {
+  return TLSRPT_KEY_FAILED_SESSION_COUNT_SIZE+tlsrpt_int_size(value);
+}
+
+/* Attributes with a fixed value */
+/* dpv: "1" in a datagram of a single delivery request */
+#define TLSRPT_ATTR_DATAGRAM_PROTOCOL_VERSION_SINGLE TLSRPT_KEY_DATAGRAM_PROTOCOL_VERSION "1" TLSRPT_STRING_END
+/* dpv: "2" in a batch datagram */
+#define TLSRPT_ATTR_DATAGRAM_PROTOCOL_VERSION_BATCH TLSRPT_KEY_DATAGRAM_PROTOCOL_VERSION "2" TLSRPT_STRING_END
+/* policy-type: 9 in a policy of type TLSRPT_NO_POLICY_FOUND */
+#define TLSRPT_ATTR_POLICY_TYPE_NO_POLICY_FOUND TLSRPT_KEY_POLICY_TYPE "9"
+/* t: 0 in a policy without failures */
+#define TLSRPT_ATTR_FAILURE_COUNT_NONE TLSRPT_KEY_FAILURE_COUNT "0"
+/* f: 0 in a policy with the final result TLSRPT_FINAL_SUCCESS */
+#define TLSRPT_ATTR_FINAL_RESULT_SUCCESS TLSRPT_KEY_FINAL_RESULT "0"
+/* tr: 1 in a policy or delivery request truncated by a limit */
+#define TLSRPT_ATTR_TRUNCATED TLSRPT_KEY_TRUNCATED "1"
+
+/* Key prefixes of the failure detail string fields, in the order of tlsrpt_failure_field_t */
+static const char* const tlsrpt_failure_field_prefixes[6]={TLSRPT_KEY_SENDING_MTA_IP, TLSRPT_KEY_RECEIVING_MX_HOSTNAME, TLSRPT_KEY_RECEIVING_MX_HELO, TLSRPT_KEY_RECEIVING_IP, TLSRPT_KEY_ADDITIONAL_INFORMATION, TLSRPT_KEY_FAILURE_REASON_CODE};
+static const size_t tlsrpt_failure_field_prefix_sizes[6]={TLSRPT_KEY_SENDING_MTA_IP_SIZE, TLSRPT_KEY_RECEIVING_MX_HOSTNAME_SIZE, TLSRPT_KEY_RECEIVING_MX_HELO_SIZE, TLSRPT_KEY_RECEIVING_IP_SIZE, TLSRPT_KEY_ADDITIONAL_INFORMATION_SIZE, TLSRPT_KEY_FAILURE_REASON_CODE_SIZE};
+
+#endif /* DATAGRAM_SERIALIZER_H */
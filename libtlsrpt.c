@@ -18,57 +18,246 @@
  */
 
 #include "tlsrpt.h"
+#include "datagram-serializer.h"
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
 #include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
-typedef struct tlsrpt_connection_t {
+/* Header of a capture file, followed by the ring of captured datagrams */
+typedef struct tlsrpt_capture_header_t {
+  char magic[8];
+  uint64_t capacity; /* size of the ring following the header */
+  uint64_t head; /* offset within the ring where the next record will be written */
+  uint64_t lap; /* number of times the ring has wrapped */
+  uint64_t lapend; /* offset where the records of the previous lap end */
+} tlsrpt_capture_header_t;
+
+/* Header of each captured datagram within the ring, records are aligned to 8 bytes */
+typedef struct tlsrpt_capture_record_t {
+  uint32_t magic; /* written last, so incomplete records are recognized */
+  uint32_t length; /* length of the datagram following the record header */
+  uint64_t timestamp; /* nanoseconds since the epoch */
+} tlsrpt_capture_record_t;
+
+#define EXPORT_MAGIC "TLSRPTD1"
+
+/* Header of an exported delivery request, followed by the failure entries and the contents of the main, ps, mx and fd memstreams */
+typedef struct tlsrpt_export_header_t {
+  char magic[8];
+  uint64_t domainhash;
+  uint64_t mainsize;
+  uint64_t pssize;
+  uint64_t mxsize;
+  uint64_t fdsize;
+  int32_t failure_count;
+  int32_t policy_count;
+  int32_t policy_type;
+  int32_t in_policy; /* 1 if the sub-memstreams of an unfinished policy follow */
+  int32_t truncated;
+  int32_t policy_truncated;
+  int32_t dropping_policy;
+  int32_t dropped_policies;
+  int32_t dropped_failures;
+  int32_t failures_used;
+} tlsrpt_export_header_t;
+
+/* A distinct failure detail of an exported delivery request, offsets are relative to the fd memstream contents */
+typedef struct tlsrpt_export_failure_t {
+  uint64_t hash;
+  int64_t offset;
+  int64_t length;
+  int32_t count;
+  int32_t reserved;
+} tlsrpt_export_failure_t;
+
+/* Number of string fields of a failure detail, in the order of tlsrpt_failure_field_t */
+#define FAILURE_FIELDS 6
+
+/* Number of limits, in the order of tlsrpt_limit_t */
+#define LIMITS 4
+
+/* Bytes reserved by the datagram limit for the worst case of what finish_policy and tlsrpt_finish_delivery_request append:
+   the lists spliced in from the sub-memstreams, the closing counts and the truncation marks */
+#define POLICY_RESERVE (TLSRPT_SIZE_POLICY_STRINGS+TLSRPT_SIZE_MX_HOSTS+TLSRPT_SIZE_FAILURE_DETAILS+sizeof(TLSRPT_ATTR_TRUNCATED)-1 \
+  +TLSRPT_MAX_SIZE_FAILURE_COUNT+TLSRPT_MAX_SIZE_FINAL_RESULT+sizeof(TLSRPT_OBJECT_END)-1)
+#define DATAGRAM_RESERVE (POLICY_RESERVE+sizeof(TLSRPT_LIST_END)-1+TLSRPT_MAX_SIZE_DROPPED_POLICIES+TLSRPT_MAX_SIZE_DROPPED_FAILURES \
+  +sizeof(TLSRPT_ATTR_TRUNCATED)-1+sizeof(TLSRPT_OBJECT_END)-1)
+
+/* Bytes a distinct failure detail needs besides its rendered attributes for braces, separator and count */
+#define FAILURE_OVERHEAD (sizeof(TLSRPT_OBJECT_ITEM)-1+TLSRPT_MAX_SIZE_FAILED_SESSION_COUNT+sizeof(TLSRPT_OBJECT_END)-1)
+
+/* A connection-level default value, escaped once into its complete JSON attribute */
+typedef struct tlsrpt_default_t {
+  char *value; /* NULL if no default value is set */
+  char *rendered;
+  size_t renderedsize;
+} tlsrpt_default_t;
+
+/* The pre-escaped "d" and "pr" attributes of a domain with a default policy record */
+typedef struct tlsrpt_domain_default_t {
+  unsigned long long hash;
+  char *domainname; /* NULL marks an empty slot */
+  char *rendered;
+  size_t renderedsize;
+} tlsrpt_domain_default_t;
+
+/* A delivery request within a batch, so the batch of a dead shard can be moved record by record */
+typedef struct tlsrpt_batch_record_t {
+  unsigned long long domainhash;
+  size_t offset; /* start of the delivery request within batchbuffer */
+  size_t size;
+} tlsrpt_batch_record_t;
+
+/* One TLSRPT collectd socket, delivery requests are distributed over the shards by their domain name */
+typedef struct tlsrpt_shard_t {
   struct sockaddr_un addr;
+  unsigned long long seed; /* hash of the socket name for rendezvous hashing */
+  long deaduntil; /* monotonic time in seconds until the shard is skipped, accessed atomically */
+
+  /* batch of delivery requests for this shard, protected by the batch mutex of the connection */
+  char *batchbuffer;
+  size_t batchsize; /* bytes used in batchbuffer */
+  int batchrecords; /* number of delivery requests in batchbuffer */
+  tlsrpt_batch_record_t *batchindex; /* the delivery requests in batchbuffer with their domain hashes */
+  struct timespec batchstart; /* time when the first record was added to the batch */
+} tlsrpt_shard_t;
+
+typedef struct tlsrpt_connection_t {
+  tlsrpt_shard_t *shards;
+  int shardcount;
   int sock_fd; /* file descriptor of socket */
+
+  /* output sink for finished datagrams, may take ownership of the datagram by setting *pdata to NULL */
+  int (*sink)(struct tlsrpt_connection_t* con, int shard, char** pdata, size_t size, int errorblock);
+  int sinkfd; /* file descriptor of the fd sink */
+  int (*sinkcallback)(void* ctx, char* datagram, size_t size); /* application function of the callback sink */
+  void *sinkctx;
+
+  /* default values for failure details and policy records, set up before the connection is used */
+  tlsrpt_default_t failuredefaults[FAILURE_FIELDS];
+  tlsrpt_domain_default_t *domaindefaults; /* open addressing table */
+  int domaindefaultsused;
+  int domaindefaultssize;
+
+  /* hard limits for delivery requests in the order of tlsrpt_limit_t, 0 means unlimited */
+  size_t limits[LIMITS];
+
+  int deduplicate; /* send identical failure details of a policy once with their count "k" */
+
+  /* batching of several delivery requests into one datagram per shard, shared by all delivery requests of this connection */
+  pthread_mutex_t batchmutex;
+  size_t batchlimit; /* maximum datagram size of a batch, 0 if batching is disabled */
+  int batchdelay; /* maximum delay in milliseconds of the first record of a batch, 0 for no deadline */
+  int batcherror; /* first error of a batch flushed while finishing a later delivery request, reported by the next flush */
+
+  /* send buffer sizing and monitoring, accessed atomically because the connection may be shared between threads */
+  int sndbuf; /* last SO_SNDBUF value set by the library, 0 if the system default is still used */
+  int sndbufmax; /* upper limit for growing SO_SNDBUF when sendto would block, 0 if adaptive sizing is disabled */
+  int queuehighwater; /* highest number of bytes observed in the send queue */
+  unsigned long sendcounter; /* successful sends, every QUEUE_SAMPLE_INTERVAL-th one samples the send queue */
+
+  /* capture of emitted datagrams into a memory-mapped ring file */
+  tlsrpt_capture_header_t *capture; /* NULL if capturing is disabled */
+  size_t capturemapsize;
+  unsigned int capturerate; /* capture one of capturerate datagrams */
+  unsigned long capturecounter;
 } tlsrpt_connection_t;
 
+/* the default sink, needed for initialization of a new connection */
+static int sink_socket(tlsrpt_connection_t* con, int shard, char** pdata, size_t size, int errorblock);
+
+/* A distinct failure detail within the current policy, rendered once into memstreamfd */
+typedef struct tlsrpt_failure_entry_t {
+  unsigned long long hash;
+  long offset; /* start of the rendered failure detail within memstreamfd */
+  long length;
+  int count; /* number of identical failures reported */
+} tlsrpt_failure_entry_t;
+
 typedef struct tlsrpt_dr_t {
   struct tlsrpt_connection_t *con;
+  unsigned long long domainhash; /* selects the shard of the connection */
   int status;
   int failure_count;
-  int policy_count;
+  int policy_count; /* number of serialized policies */
+  int in_policy; /* between tlsrpt_init_policy and tlsrpt_finish_policy of a serialized policy */
+
+  /* truncation by the limits of the connection */
+  int truncated; /* something was dropped or cut in this delivery request */
+  int policy_truncated; /* something was dropped or cut in the current policy */
+  int dropping_policy; /* the current policy is dropped by the policies limit */
+  int dropped_policies;
+  int dropped_failures; /* failure count of the dropped policies */
 
   /* main memstream */
   FILE *memstream;
   char *memstreambuffer;
   size_t memstreamsize;
 
-  /* sub-memstream for policy strings */
+  /* sub-memstream for policy strings, opened on first use like the other sub-memstreams */
   FILE *memstreamps;
   char *memstreambufferps;
   size_t memstreamsizeps;
-  const char* separatorps;
+  int firstps; /* no policy string was written yet */
 
   /* sub-memstream for mx host patterns */
   FILE *memstreammx;
   char *memstreambuffermx;
   size_t memstreamsizemx;
-  const char* separatormx;
+  int firstmx; /* no mx host pattern was written yet */
 
   /* sub-memstream for failure details */
   FILE *memstreamfd;
   char *memstreambufferfd;
   size_t memstreamsizefd;
-  const char* separatorfd;
+
+  /* distinct failure details and their hash index for deduplication */
+  tlsrpt_failure_entry_t *failures;
+  int failures_used;
+  int failures_alloc;
+  int *failure_index; /* open addressing table of indices into failures plus one, zero marks an empty slot */
+  int failure_index_size;
 
   tlsrpt_policy_type_t policy_type;
 } tlsrpt_dr_t;
 
 
-extern const char *tlsrpt_json_escape_values[256];
+/* The marker to use a default value, only its address is significant */
+const char tlsrpt_use_default[]="";
 
 #define BUFFER_SIZE 65000
 
+/* A shard that refused a datagram is skipped for this many seconds before it is tried again */
+#define SHARD_RETRY_SECONDS 10
+
+/* The send queue depth is sampled after this many successful sends for the high-water mark */
+#define QUEUE_SAMPLE_INTERVAL 64
+
+#define CAPTURE_FILE_MAGIC "TLSRPTC1"
+#define CAPTURE_RECORD_MAGIC 0x43455254
+#define CAPTURE_ALIGN(size) (((size)+7) & ~((size_t)7))
+
+/* A batch datagram wraps the individual delivery request datagrams into a list */
+#define BATCH_PREFIX TLSRPT_OBJECT_BEGIN TLSRPT_ATTR_DATAGRAM_PROTOCOL_VERSION_BATCH TLSRPT_KEY_BATCH
+#define BATCH_SUFFIX TLSRPT_LIST_END TLSRPT_OBJECT_END
+
+/* The mandatory parts of a delivery request datagram, bounding the number of records a batch can hold */
+#define MIN_DATAGRAM_SIZE (sizeof(TLSRPT_OBJECT_BEGIN TLSRPT_ATTR_DATAGRAM_PROTOCOL_VERSION_SINGLE TLSRPT_KEY_DOMAIN TLSRPT_STRING_END \
+  TLSRPT_KEY_POLICY_RECORD TLSRPT_STRING_END TLSRPT_KEY_POLICIES TLSRPT_OBJECT_BEGIN TLSRPT_ATTR_POLICY_TYPE_NO_POLICY_FOUND \
+  TLSRPT_ATTR_FAILURE_COUNT_NONE TLSRPT_ATTR_FINAL_RESULT_SUCCESS TLSRPT_OBJECT_END TLSRPT_LIST_END TLSRPT_OBJECT_END)-1)
+
 #define DEBUG if(0)
 
 /* Check if this library version is compatible with an MTA compiled for major.minor.patch */
@@ -113,18 +302,38 @@ const char* tlsrpt_strerror(int errorcode) {
   case TLSRPT_ERR_TLSRPT_SOCKETNAMETOOLONG: return INTERNAL_ERROR_STRERROR_PREFIX "The name of the unix domain socket was too long";
   case TLSRPT_ERR_TLSRPT_UNFINISHEDPOLICY: return INTERNAL_ERROR_STRERROR_PREFIX "Call to tlsrpt_init_policy was not properly paired with tlsrpt_finish_policy";
   case TLSRPT_ERR_TLSRPT_NOCONNECTION: return INTERNAL_ERROR_STRERROR_PREFIX "Connection pointer is NULL";
+  case TLSRPT_ERR_TLSRPT_NOSOCKETNAME: return INTERNAL_ERROR_STRERROR_PREFIX "No socket name was given";
   case TLSRPT_ERR_TLSRPT_MEMSTREAM_NOT_INITIALIZED: return INTERNAL_ERROR_STRERROR_PREFIX "The internal main memstream was not initialized";
   case TLSRPT_ERR_TLSRPT_MEMSTREAMPS_NOT_INITIALIZED: return INTERNAL_ERROR_STRERROR_PREFIX "The internal ps memstream was not initialized";
   case TLSRPT_ERR_TLSRPT_MEMSTREAMMX_NOT_INITIALIZED: return INTERNAL_ERROR_STRERROR_PREFIX "The internal mx memstream was not initialized";
   case TLSRPT_ERR_TLSRPT_MEMSTREAMFD_NOT_INITIALIZED: return INTERNAL_ERROR_STRERROR_PREFIX "The internal fd memstream was not initialized";
   case TLSRPT_ERR_TLSRPT_NESTEDPOLICY: return INTERNAL_ERROR_STRERROR_PREFIX "Two calls to tlsrpt_init_policy without properly calling tlsrpt_finish_policy on the first one";
   case TLSRPT_ERR_TLSRPT_NOPOLICIES: return INTERNAL_ERROR_STRERROR_PREFIX "No policies were added";
+  case TLSRPT_ERR_TLSRPT_NOTINPOLICY: return INTERNAL_ERROR_STRERROR_PREFIX "Policy details were added or a policy was finished outside of a policy";
+  case TLSRPT_ERR_TLSRPT_CAPTUREINVALID: return INTERNAL_ERROR_STRERROR_PREFIX "The file is not a valid capture file";
+  case TLSRPT_ERR_TLSRPT_CALLBACKFAILED: return INTERNAL_ERROR_STRERROR_PREFIX "The callback sink rejected the datagram";
+  case TLSRPT_ERR_TLSRPT_NODEFAULT: return INTERNAL_ERROR_STRERROR_PREFIX "No default value was set for the domain or failure detail field";
+  case TLSRPT_ERR_TLSRPT_INVALIDLIMIT: return INTERNAL_ERROR_STRERROR_PREFIX "Invalid limit";
+  case TLSRPT_ERR_TLSRPT_DOMAINTOOLARGE: return INTERNAL_ERROR_STRERROR_PREFIX "The domain and the policy record alone exceed the datagram limit";
+  case TLSRPT_ERR_TLSRPT_INVALIDEXPORT: return INTERNAL_ERROR_STRERROR_PREFIX "The data is not a valid exported delivery request";
+  case TLSRPT_ERR_TLSRPT_INVALIDSNDBUF: return INTERNAL_ERROR_STRERROR_PREFIX "Invalid send buffer size";
+  case TLSRPT_ERR_TLSRPT_INVALIDFIELD: return INTERNAL_ERROR_STRERROR_PREFIX "Invalid failure detail field";
     // errors from the C-library
   case TLSRPT_ERR_SOCKET: return "TLSRPT error in call to socket in tlsrpt_open";
   case TLSRPT_ERR_CLOSE: return "TLSRPT error in call to close in tlsrpt_close";
   case TLSRPT_ERR_SENDTO: return "TLSRPT error in call to sendto in finishdr";
+  case TLSRPT_ERR_SENDTO_FLUSH: return "TLSRPT error in call to sendto in flush";
+  case TLSRPT_ERR_SETSOCKOPT: return "TLSRPT error in call to setsockopt in setsndbuf";
+  case TLSRPT_ERR_GETSOCKOPT: return "TLSRPT error in call to getsockopt in getsendqueue";
+  case TLSRPT_ERR_IOCTL: return "TLSRPT error in call to ioctl in getsendqueue";
+  case TLSRPT_ERR_WRITEV: return "TLSRPT error in call to writev in the fd sink";
+  case TLSRPT_ERR_OPEN_CAPTURE: return "TLSRPT error in call to open in setcapture or replaycapture";
+  case TLSRPT_ERR_FALLOCATE_CAPTURE: return "TLSRPT error in call to posix_fallocate in setcapture";
+  case TLSRPT_ERR_MMAP_CAPTURE: return "TLSRPT error in call to mmap in setcapture or replaycapture";
   case TLSRPT_ERR_OPEN_MEMSTREAM_INITDR: return "TLSRPT error in call to open_memstream in initdr";
   case TLSRPT_ERR_OPEN_MEMSTREAM_INITPOLICY: return "TLSRPT error in call to open_memstream in initpolicy";
+  case TLSRPT_ERR_OPEN_MEMSTREAM_IMPORTDR: return "TLSRPT error in call to open_memstream in importdr";
+  case TLSRPT_ERR_FFLUSH_EXPORTDR: return "TLSRPT error in call to fflush in exportdr";
   case TLSRPT_ERR_FCLOSE_FINISHPOLICY: return "TLSRPT error in call to fclose in finishpolicy";
   case TLSRPT_ERR_FCLOSE_FINISHDR: return "TLSRPT error in call to fclose in finishdr";
   case TLSRPT_ERR_FPRINTF_INITDR: return "TLSRPT error in call to fprintf in initdr";
@@ -136,6 +345,11 @@ const char* tlsrpt_strerror(int errorcode) {
   case TLSRPT_ERR_FPRINTF_FINISHDR: return "TLSRPT error in call to fprintf in finishdr";
   case TLSRPT_ERR_MALLOC_OPENCON: return "TLSRPT error in call to malloc in opencon";
   case TLSRPT_ERR_MALLOC_OPENDR: return "TLSRPT error in call to malloc in opendr";
+  case TLSRPT_ERR_MALLOC_ADDFAILURE: return "TLSRPT error in call to malloc in addfailure";
+  case TLSRPT_ERR_MALLOC_SETBATCHING: return "TLSRPT error in call to malloc in setbatching";
+  case TLSRPT_ERR_MALLOC_SETDEFAULT: return "TLSRPT error in call to malloc in setdefault";
+  case TLSRPT_ERR_MALLOC_EXPORTDR: return "TLSRPT error in call to malloc in exportdr";
+  case TLSRPT_ERR_MALLOC_IMPORTDR: return "TLSRPT error in call to malloc in importdr";
   default:
     return "UNKNOWN TLSRPT ERROR CODE";
   }
@@ -155,51 +369,302 @@ void tlsrpt_set_malloc_and_free(void* (*malloc_function)(size_t size), void (*fr
 }
 
 
-/* Write a JSON-escaped value to a file */
-static int json_escape(FILE* file, const char* s) {
-  for(const unsigned char *c=(unsigned char*)s; *c!=0; ++c) {
-    if(fprintf(file,"%s",tlsrpt_json_escape_values[*c])<0) return -1;
+/* Returns the number of bytes of a field to serialize, cut at a UTF-8 character boundary if the field is longer than limit */
+static size_t field_length(const char* s, size_t limit) {
+  size_t length=strlen(s);
+  if(limit==0 || length<=limit) return length;
+  length=limit;
+  while(length>0 && ((unsigned char)s[length] & 0xC0)==0x80) --length;
+  return length;
+}
+
+/* Writes a failure detail string field with its generated key prefix only if value is not NULL, the value is cut to limit bytes unless limit is 0.
+   Returns 1 if the value was cut */
+static int write_failure_field_if_not_null(FILE *file, int field, const char* value, size_t limit) {
+  if(value==NULL) return 0;
+  size_t length=field_length(value, limit);
+  if(tlsrpt_serialize_string(file, tlsrpt_failure_field_prefixes[field], tlsrpt_failure_field_prefix_sizes[field], value, length)<0) return -1;
+  return value[length]!=0;
+}
+
+/* Returns the size of a failure detail as written by tlsrpt_add_delivery_request_failure, without its braces and count */
+static size_t failure_size(const tlsrpt_connection_t* con, int failure_code, const char** fields, size_t limit) {
+  size_t size=tlsrpt_size_failure_code(failure_code);
+  for(int i=0; i<FAILURE_FIELDS; ++i) {
+    if(fields[i]==NULL) continue;
+    if(fields[i]==con->failuredefaults[i].value) {
+      size+=con->failuredefaults[i].renderedsize;
+    } else {
+      size+=tlsrpt_failure_field_prefix_sizes[i]+tlsrpt_json_escaped_size(fields[i], field_length(fields[i], limit))+sizeof(TLSRPT_STRING_END)-1;
+    }
+  }
+  return size;
+}
+
+/* Writes the list of distinct failure details, adding the count to failure details that were added more than once */
+static int write_failure_details(FILE *file, const tlsrpt_failure_entry_t *failures, int failures_used, const char* rendered) {
+  if(tlsrpt_serialize_failure_details_begin(file)<0) return -1;
+  for(int i=0; i<failures_used; ++i) {
+    if(((i==0)?TLSRPT_SERIALIZE_LITERAL(file, TLSRPT_OBJECT_BEGIN):TLSRPT_SERIALIZE_LITERAL(file, TLSRPT_OBJECT_ITEM))<0) return -1;
+    if(fwrite(rendered+failures[i].offset, 1, failures[i].length, file)!=(size_t)failures[i].length) return -1;
+    if(failures[i].count>1 && tlsrpt_serialize_failed_session_count(file, failures[i].count)<0) return -1;
+    if(TLSRPT_SERIALIZE_LITERAL(file, TLSRPT_OBJECT_END)<0) return -1;
+  }
+  return TLSRPT_SERIALIZE_LITERAL(file, TLSRPT_LIST_END);
+}
+
+/* FNV-1a hashing of the failure detail fields */
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static unsigned long long hash_field(unsigned long long hash, const char* data, size_t length) {
+  for(size_t i=0; i<length; ++i) {
+    hash^=(unsigned char)data[i];
+    hash*=FNV_PRIME;
+  }
+  return hash;
+}
+
+/* Hashes the first length bytes of a string followed by a zero byte, so that adjacent fields can not be shifted into each other */
+static unsigned long long hash_string_prefix(unsigned long long hash, const char* s, size_t length) {
+  if(s==NULL) return hash_field(hash, "\xff", 1);
+  hash=hash_field(hash, s, length);
+  return hash_field(hash, "", 1);
+}
+
+/* Hashes a string including its terminating zero byte */
+static unsigned long long hash_string_field(unsigned long long hash, const char* s) {
+  return hash_string_prefix(hash, s, (s==NULL)?0:strlen(s));
+}
+
+/* Consumes a literal from the rendered failure detail if it matches */
+static int match_literal(const char** p, const char* end, const char* literal) {
+  size_t length=strlen(literal);
+  if((size_t)(end-*p)<length || memcmp(*p, literal, length)!=0) return 0;
+  *p+=length;
+  return 1;
+}
+
+/* Consumes a failure detail string field from the rendered failure detail if it matches what write_failure_field_if_not_null would write */
+static int match_failure_field_if_not_null(const char** p, const char* end, int field, const char* value, size_t limit) {
+  if(value==NULL) return 1;
+  if(!match_literal(p, end, tlsrpt_failure_field_prefixes[field])) return 0;
+  const unsigned char *valueend=(const unsigned char*)value+field_length(value, limit);
+  for(const unsigned char *c=(const unsigned char*)value; c<valueend; ++c) {
+    if(tlsrpt_json_escape_lengths[*c]==1) {
+      /* bytes that need no escaping are compared directly */
+      if(*p==end || (unsigned char)**p!=*c) return 0;
+      ++*p;
+    } else if(!match_literal(p, end, tlsrpt_json_escape_values[*c])) {
+      return 0;
+    }
+  }
+  return match_literal(p, end, "\"");
+}
+
+/* Checks if a rendered failure detail describes the given failure, without escaping the new failure into a buffer first */
+static int failure_matches(const char* rendered, long length, const tlsrpt_connection_t* con, tlsrpt_failure_t failure_code, const char** fields) {
+  const char *p=rendered;
+  const char *end=rendered+length;
+  char code[TLSRPT_INT_MAX_SIZE];
+  size_t codesize=tlsrpt_format_int(code, failure_code);
+  if(!match_literal(&p, end, TLSRPT_KEY_FAILURE_CODE) || (size_t)(end-p)<codesize || memcmp(p, code, codesize)!=0) return 0;
+  p+=codesize;
+  for(int i=0; i<FAILURE_FIELDS; ++i) {
+    if(fields[i]!=NULL && fields[i]==con->failuredefaults[i].value) {
+      /* default values are compared in their pre-escaped form */
+      if((size_t)(end-p)<con->failuredefaults[i].renderedsize || memcmp(p, con->failuredefaults[i].rendered, con->failuredefaults[i].renderedsize)!=0) return 0;
+      p+=con->failuredefaults[i].renderedsize;
+    } else if(!match_failure_field_if_not_null(&p, end, i, fields[i], con->limits[TLSRPT_LIMIT_BYTES_PER_FIELD])) {
+      return 0;
+    }
+  }
+  return p==end;
+}
+
+/* Resizes the failure hash index to a new power of two size and re-inserts all distinct failures */
+static int rebuild_failure_index(tlsrpt_dr_t *dr, int size) {
+  int *index=calloc(size, sizeof(int));
+  if(index==NULL) return -1;
+  for(int i=0; i<dr->failures_used; ++i) {
+    int slot=(int)(dr->failures[i].hash & (size-1));
+    while(index[slot]!=0) slot=(slot+1) & (size-1);
+    index[slot]=i+1;
   }
+  free(dr->failure_index);
+  dr->failure_index=index;
+  dr->failure_index_size=size;
   return 0;
 }
 
-/* write a key/value pair with a numeric failure code value to a file */
-static int write_failure_code(FILE *file, const char* name, tlsrpt_failure_t failure_code) {
-  if(fprintf(file, "\"%s\":%d", name, failure_code)<0) return -1;
+/* Escapes one or two attributes with their generated key prefixes once into a buffer for later splicing into datagrams */
+static int render_attributes(char** prendered, size_t* prenderedsize, const char* prefix1, const char* value1, const char* prefix2, const char* value2) {
+  *prendered=NULL;
+  *prenderedsize=0;
+  FILE *memstream=open_memstream(prendered, prenderedsize);
+  if(memstream==NULL) return -1;
+  int res=tlsrpt_serialize_string(memstream, prefix1, strlen(prefix1), value1, strlen(value1));
+  if(res==0 && prefix2!=NULL) res=tlsrpt_serialize_string(memstream, prefix2, strlen(prefix2), value2, strlen(value2));
+  if(fclose(memstream)!=0) res=-1;
+  if(res!=0) {
+    free(*prendered);
+    *prendered=NULL;
+  }
+  return res;
+}
+
+/* Returns the default policy record of a domain or NULL if there is none */
+static const tlsrpt_domain_default_t* find_domain_default(const tlsrpt_connection_t* con, const char* domainname) {
+  if(con->domaindefaultssize==0) return NULL;
+  unsigned long long hash=hash_string_field(FNV_OFFSET_BASIS, domainname);
+  int mask=con->domaindefaultssize-1;
+  for(int slot=(int)(hash & mask); con->domaindefaults[slot].domainname!=NULL; slot=(slot+1) & mask) {
+    if(con->domaindefaults[slot].hash==hash && strcmp(con->domaindefaults[slot].domainname, domainname)==0) return &con->domaindefaults[slot];
+  }
+  return NULL;
+}
+
+static void free_defaults(tlsrpt_connection_t* con) {
+  for(int i=0; i<FAILURE_FIELDS; ++i) {
+    free(con->failuredefaults[i].value);
+    free(con->failuredefaults[i].rendered);
+  }
+  memset(con->failuredefaults, 0, sizeof(con->failuredefaults));
+  for(int i=0; i<con->domaindefaultssize; ++i) {
+    free(con->domaindefaults[i].domainname);
+    free(con->domaindefaults[i].rendered);
+  }
+  free(con->domaindefaults);
+  con->domaindefaults=NULL;
+  con->domaindefaultsused=0;
+  con->domaindefaultssize=0;
+}
+
+int tlsrpt_set_failure_default(struct tlsrpt_connection_t* con, tlsrpt_failure_field_t field, const char* value) {
+  if(field<0 || field>=FAILURE_FIELDS) return TLSRPT_ERR_TLSRPT_INVALIDFIELD;
+  tlsrpt_default_t *d=&con->failuredefaults[field];
+  free(d->value);
+  free(d->rendered);
+  memset(d, 0, sizeof(tlsrpt_default_t));
+  if(value==NULL) return 0;
+
+  char *copy=strdup(value);
+  if(copy==NULL) return TLSRPT_ERR_MALLOC_SETDEFAULT+errno;
+  if(render_attributes(&d->rendered, &d->renderedsize, tlsrpt_failure_field_prefixes[field], value, NULL, NULL)!=0) {
+    free(copy);
+    return TLSRPT_ERR_MALLOC_SETDEFAULT+errno;
+  }
+  d->value=copy;
   return 0;
 }
 
-/* Writes the first attribute of a JSON list without a leading "," separator */
-static int write_first_attribute(FILE *file, const char* name, const char* value) {
-  if(fprintf(file, "\"%s\": \"", name)<0) return -1;
-  if(json_escape(file, value)<0) return -1;
-  if(fprintf(file, "\"")<0) return -1;
+int tlsrpt_set_policyrecord_default(struct tlsrpt_connection_t* con, const char* domainname, const char* policyrecord) {
+  /* keep the table at most half full */
+  if((con->domaindefaultsused+1)*2>con->domaindefaultssize) {
+    int size=con->domaindefaultssize>0?con->domaindefaultssize*2:16;
+    tlsrpt_domain_default_t *table=calloc(size, sizeof(tlsrpt_domain_default_t));
+    if(table==NULL) return TLSRPT_ERR_MALLOC_SETDEFAULT+errno;
+    for(int i=0; i<con->domaindefaultssize; ++i) {
+      if(con->domaindefaults[i].domainname==NULL) continue;
+      int slot=(int)(con->domaindefaults[i].hash & (size-1));
+      while(table[slot].domainname!=NULL) slot=(slot+1) & (size-1);
+      table[slot]=con->domaindefaults[i];
+    }
+    free(con->domaindefaults);
+    con->domaindefaults=table;
+    con->domaindefaultssize=size;
+  }
+
+  unsigned long long hash=hash_string_field(FNV_OFFSET_BASIS, domainname);
+  int mask=con->domaindefaultssize-1;
+  int slot=(int)(hash & mask);
+  while(con->domaindefaults[slot].domainname!=NULL && (con->domaindefaults[slot].hash!=hash || strcmp(con->domaindefaults[slot].domainname, domainname)!=0)) slot=(slot+1) & mask;
+  tlsrpt_domain_default_t *d=&con->domaindefaults[slot];
+
+  char *rendered;
+  size_t renderedsize;
+  if(render_attributes(&rendered, &renderedsize, TLSRPT_KEY_DOMAIN, domainname, TLSRPT_KEY_POLICY_RECORD, policyrecord)!=0) return TLSRPT_ERR_MALLOC_SETDEFAULT+errno;
+  if(d->domainname==NULL) {
+    d->domainname=strdup(domainname);
+    if(d->domainname==NULL) {
+      free(rendered);
+      return TLSRPT_ERR_MALLOC_SETDEFAULT+errno;
+    }
+    d->hash=hash;
+    ++con->domaindefaultsused;
+  }
+  free(d->rendered);
+  d->rendered=rendered;
+  d->renderedsize=renderedsize;
   return 0;
 }
 
-/* Writes an additional attribute of a JSON list prepended by a "," separator */
-static int write_attribute(FILE *file, const char* name, const char* value) {
-  if(fprintf(file,",")<0) return -1;
-  return write_first_attribute(file, name, value);
+int tlsrpt_set_limit(struct tlsrpt_connection_t* con, tlsrpt_limit_t limit, size_t value) {
+  if(limit<0 || limit>=LIMITS) return TLSRPT_ERR_TLSRPT_INVALIDLIMIT;
+  con->limits[limit]=value;
+  return 0;
 }
 
-/* Writes an additional attribute of a JSON list prepended by a "," separator only if value is not NULL */
-static int write_attribute_if_not_null(FILE *file, const char* name, const char* value) {
-  if(value==NULL) return 0;
-  return write_attribute(file, name, value);
+int tlsrpt_set_deduplication(struct tlsrpt_connection_t* con, int enabled) {
+  con->deduplicate=(enabled!=0);
+  return 0;
 }
 
-static int tlsrpt_open_prepare_struct(struct tlsrpt_connection_t* con, const char* socketname) {
+static int tlsrpt_open_prepare_struct(struct tlsrpt_connection_t* con, const char** socketnames, int count) {
   /*  no calls to errorcode from this function because we have no tlsrpt_dr struct yet to record the error */
 
-  /* Clear the socket address structure */
-  memset(&con->addr, 0, sizeof(struct sockaddr_un));
+  con->shards=NULL;
+  con->shardcount=0;
   con->sock_fd = -1;
 
-  /* Set destination address */
-  if(strlen(socketname)>sizeof(con->addr.sun_path) - 1) return TLSRPT_ERR_TLSRPT_SOCKETNAMETOOLONG;
-  con->addr.sun_family = AF_UNIX;
-  strncpy(con->addr.sun_path, socketname, sizeof(con->addr.sun_path) - 1);
+  /* Datagrams are sent to the socket by default */
+  con->sink=sink_socket;
+  con->sinkfd=-1;
+  con->sinkcallback=NULL;
+  con->sinkctx=NULL;
+
+  /* No limits are set */
+  memset(con->limits, 0, sizeof(con->limits));
+
+  /* Identical failure details are sent individually unless deduplication is enabled */
+  con->deduplicate=0;
+
+  /* No default values are set */
+  memset(con->failuredefaults, 0, sizeof(con->failuredefaults));
+  con->domaindefaults=NULL;
+  con->domaindefaultsused=0;
+  con->domaindefaultssize=0;
+
+  /* Batching is disabled by default */
+  pthread_mutex_init(&con->batchmutex, NULL);
+  con->batchlimit=0;
+  con->batchdelay=0;
+  con->batcherror=0;
+
+  /* Send buffer sizing is left to the system by default */
+  con->sndbuf=0;
+  con->sndbufmax=0;
+  con->queuehighwater=0;
+  con->sendcounter=0;
+
+  /* Capturing is disabled by default */
+  con->capture=NULL;
+  con->capturemapsize=0;
+  con->capturerate=0;
+  con->capturecounter=0;
+
+  /* Set destination addresses, the shards are zero-initialized */
+  if(count<1) return TLSRPT_ERR_TLSRPT_NOSOCKETNAME;
+  con->shards=calloc(count, sizeof(tlsrpt_shard_t));
+  if(con->shards==NULL) return TLSRPT_ERR_MALLOC_OPENCON+errno;
+  con->shardcount=count;
+  for(int i=0; i<count; ++i) {
+    tlsrpt_shard_t *shard=&con->shards[i];
+    if(strlen(socketnames[i])>sizeof(shard->addr.sun_path) - 1) return TLSRPT_ERR_TLSRPT_SOCKETNAMETOOLONG;
+    shard->addr.sun_family = AF_UNIX;
+    strncpy(shard->addr.sun_path, socketnames[i], sizeof(shard->addr.sun_path) - 1);
+    shard->seed=hash_string_field(FNV_OFFSET_BASIS, socketnames[i]);
+  }
 
   /* Create local socket */
   con->sock_fd = socket(AF_UNIX, SOCK_DGRAM, 0);
@@ -214,11 +679,22 @@ int tlsrpt_close(struct tlsrpt_connection_t** pcon) {
   /*  no calls to errorcode from this function because we have no tlsrpt_dr struct to record the error */
   int res = 0;
   struct tlsrpt_connection_t* con=*pcon;
-  memset(&con->addr, 0, sizeof(struct sockaddr_un));
+  /* Send out delivery requests still waiting in the batch */
+  res=tlsrpt_flush(con);
+  for(int i=0; i<con->shardcount; ++i) {
+    free(con->shards[i].batchbuffer);
+    free(con->shards[i].batchindex);
+  }
+  free(con->shards);
+  con->shards=NULL;
+  con->shardcount=0;
+  pthread_mutex_destroy(&con->batchmutex);
+  if(con->capture!=NULL) munmap(con->capture, con->capturemapsize);
+  free_defaults(con);
   if(con->sock_fd!=-1) {
-    res = close(con->sock_fd);
+    int closeres = close(con->sock_fd);
     con->sock_fd=-1;
-    if(res != 0) res=TLSRPT_ERR_CLOSE+errno;
+    if(closeres != 0 && res == 0) res=TLSRPT_ERR_CLOSE+errno;
   }
   tlsrpt_free(con);
   *pcon=NULL;
@@ -226,11 +702,15 @@ int tlsrpt_close(struct tlsrpt_connection_t** pcon) {
 }
 
 int tlsrpt_open(struct tlsrpt_connection_t** pcon, const char* socketname) {
+  return tlsrpt_open_shards(pcon, &socketname, 1);
+}
+
+int tlsrpt_open_shards(struct tlsrpt_connection_t** pcon, const char** socketnames, int count) {
   *pcon=NULL;
   struct tlsrpt_connection_t* ptr=(struct tlsrpt_connection_t*)tlsrpt_malloc(sizeof(struct tlsrpt_connection_t));
   if(ptr==NULL) return TLSRPT_ERR_MALLOC_OPENCON+errno;
 
-  int res=tlsrpt_open_prepare_struct(ptr, socketname);
+  int res=tlsrpt_open_prepare_struct(ptr, socketnames, count);
   if(res==0) {
     *pcon=ptr;
     return 0;
@@ -240,45 +720,75 @@ int tlsrpt_open(struct tlsrpt_connection_t** pcon, const char* socketname) {
   return res;
 }
 
-/* Index of json keys
+/* Marks the current policy and the delivery request as truncated by a limit */
+static void mark_truncated(tlsrpt_dr_t *dr) {
+  dr->policy_truncated=1;
+  dr->truncated=1;
+}
 
-a : failure_details.additional_information
-c : failure_details.failure_code
-f : failure_details.failure_reason_code
-h : failure_details.receiving_mx_helo
-n : failure_details.receiving_mx_hostname
-r : failure_details.receiving_ip
-s : failure_details.sending_mta_ip
-*/
+/* Checks if the serialized delivery request plus extra bytes and the closing overhead exceeds the datagram limit */
+static int exceeds_datagram_limit(tlsrpt_dr_t *dr, long extra) {
+  size_t limit=dr->con->limits[TLSRPT_LIMIT_BYTES_PER_DATAGRAM];
+  if(limit==0) return 0;
+  long size=ftell(dr->memstream)+extra+(long)DATAGRAM_RESERVE+(long)dr->failures_used*(long)FAILURE_OVERHEAD;
+  if(dr->memstreamps!=NULL) size+=ftell(dr->memstreamps);
+  if(dr->memstreammx!=NULL) size+=ftell(dr->memstreammx);
+  if(dr->memstreamfd!=NULL) size+=ftell(dr->memstreamfd);
+  return size>(long)limit;
+}
+
+/* Items are checked against the datagram limit with their generated size before they are written, the sizes are only calculated if the limit is set */
+static int has_datagram_limit(const tlsrpt_dr_t *dr) {
+  return dr->con->limits[TLSRPT_LIMIT_BYTES_PER_DATAGRAM]!=0;
+}
+
+/* Opens a sub-memstream of the current policy on first use, policies without details never allocate them */
+static FILE* sub_memstream(FILE** pmemstream, char** pbuffer, size_t* psize) {
+  if(*pmemstream==NULL) *pmemstream=open_memstream(pbuffer, psize);
+  return *pmemstream;
+}
 
 static void reset_sub_memstreams(tlsrpt_dr_t *dr) {
   /* sub_memstreams are resetted for a new policy, therefore also reset failure_count */
   dr->failure_count=0;
+  dr->policy_truncated=0;
+  dr->in_policy=0;
 
   /* sub-memstream for policy strings */
-  dr->separatorps="";
+  dr->firstps=1;
   dr->memstreamps=NULL;
   dr->memstreambufferps=NULL;
   dr->memstreamsizeps=0;
 
   /* sub-memstream for mx host patterns */
-  dr->separatormx="";
+  dr->firstmx=1;
   dr->memstreammx=NULL;
   dr->memstreambuffermx=NULL;
   dr->memstreamsizemx=0;
 
   /* sub-memstream for failure details */
-  dr->separatorfd="";
   dr->memstreamfd=NULL;
   dr->memstreambufferfd=NULL;
   dr->memstreamsizefd=0;
+
+  /* index of distinct failure details */
+  dr->failures=NULL;
+  dr->failures_used=0;
+  dr->failures_alloc=0;
+  dr->failure_index=NULL;
+  dr->failure_index_size=0;
 }
 
 static int tlsrpt_init_delivery_request_prepare_struct(tlsrpt_dr_t *dr, tlsrpt_connection_t* con, const char* domainname, const char* policyrecord) {
   int res=0;
   dr->status=0;
   dr->con=con;
+  dr->domainhash=0;
   dr->policy_count=0;
+  dr->truncated=0;
+  dr->dropping_policy=0;
+  dr->dropped_policies=0;
+  dr->dropped_failures=0;
 
   reset_sub_memstreams(dr);
 
@@ -287,17 +797,27 @@ static int tlsrpt_init_delivery_request_prepare_struct(tlsrpt_dr_t *dr, tlsrpt_c
   dr->memstreamsize=0;
   dr->memstream=open_memstream(&dr->memstreambuffer, &dr->memstreamsize);
   if(dr->memstream==NULL) return errorcode(dr, TLSRPT_ERR_OPEN_MEMSTREAM_INITDR+errno);
-  res=fprintf(dr->memstream, "{");
+  res=TLSRPT_SERIALIZE_LITERAL(dr->memstream, TLSRPT_OBJECT_BEGIN TLSRPT_ATTR_DATAGRAM_PROTOCOL_VERSION_SINGLE);
   if(res<0) return errorcode(dr, TLSRPT_ERR_FPRINTF_INITDR+errno);
-  res=write_first_attribute(dr->memstream, "dpv", "1"); /* Datagram protocol version */
-  if(res<0) return errorcode(dr, TLSRPT_ERR_FPRINTF_INITDR+errno);
-  res=write_attribute(dr->memstream, "d", domainname);
-  if(res<0) return errorcode(dr, TLSRPT_ERR_FPRINTF_INITDR+errno);
-  res=write_attribute(dr->memstream, "pr", policyrecord);
-  if(res<0) return errorcode(dr, TLSRPT_ERR_FPRINTF_INITDR+errno);
-
   if(dr->con==NULL) return errorcode(dr,TLSRPT_ERR_TLSRPT_NOCONNECTION);
 
+  if(policyrecord==TLSRPT_USE_DEFAULT) {
+    /* splice in the pre-escaped domain name and policy record */
+    const tlsrpt_domain_default_t *d=find_domain_default(con, domainname);
+    if(d==NULL) return errorcode(dr, TLSRPT_ERR_TLSRPT_NODEFAULT);
+    dr->domainhash=d->hash;
+    if(fwrite(d->rendered, 1, d->renderedsize, dr->memstream)!=d->renderedsize) return errorcode(dr, TLSRPT_ERR_FPRINTF_INITDR+errno);
+  } else {
+    /* computed for every connection, an exported delivery request may be imported into a sharded one */
+    dr->domainhash=hash_string_field(FNV_OFFSET_BASIS, domainname);
+    /* the domain and the policy record are never cut, the collectd aggregates by them and takes the rua address from the policy record */
+    res=tlsrpt_serialize_domain(dr->memstream, domainname, strlen(domainname));
+    if(res<0) return errorcode(dr, TLSRPT_ERR_FPRINTF_INITDR+errno);
+    res=tlsrpt_serialize_policy_record(dr->memstream, policyrecord, strlen(policyrecord));
+    if(res<0) return errorcode(dr, TLSRPT_ERR_FPRINTF_INITDR+errno);
+  }
+  if(exceeds_datagram_limit(dr, 0)) return errorcode(dr, TLSRPT_ERR_TLSRPT_DOMAINTOOLARGE);
+
   return 0;
 }
 
@@ -307,33 +827,54 @@ int tlsrpt_init_policy(struct tlsrpt_dr_t* dr, tlsrpt_policy_type_t policy_type,
   RETURN_ON_EXISTING_ERRORS;
 
   /* Check if we are already within a policy before resetting the memstreams! */
-  if(dr->memstreamps!=NULL) return errorcode(dr, TLSRPT_ERR_TLSRPT_NESTEDPOLICY);
+  if(dr->in_policy || dr->dropping_policy) return errorcode(dr, TLSRPT_ERR_TLSRPT_NESTEDPOLICY);
 
   reset_sub_memstreams(dr);
 
-  /* sub-memstream for policy strings */
-  dr->memstreamps=open_memstream(&dr->memstreambufferps, &dr->memstreamsizeps);
-  if(dr->memstreamps==NULL) return errorcode(dr, TLSRPT_ERR_OPEN_MEMSTREAM_INITPOLICY+errno);
-  /* sub-memstream for mx host patterns */
-  dr->memstreammx=open_memstream(&dr->memstreambuffermx, &dr->memstreamsizemx);
-  if(dr->memstreammx==NULL) return errorcode(dr, TLSRPT_ERR_OPEN_MEMSTREAM_INITPOLICY+errno);
-  /* sub-memstream for failure details */
-  dr->memstreamfd=open_memstream(&dr->memstreambufferfd, &dr->memstreamsizefd);
-  if(dr->memstreamfd==NULL) return errorcode(dr, TLSRPT_ERR_OPEN_MEMSTREAM_INITPOLICY+errno);
+  size_t maxpolicies=dr->con->limits[TLSRPT_LIMIT_POLICIES_PER_REQUEST];
+  if(maxpolicies>0 && (size_t)dr->policy_count>=maxpolicies) {
+    /* only the number of policies and their failures are kept */
+    dr->dropping_policy=1;
+    ++dr->dropped_policies;
+    dr->truncated=1;
+    return 0;
+  }
 
-  dr->policy_type=policy_type;
+  /* the first policy is always kept, further policies are dropped if their header would exceed the datagram limit */
+  if(dr->policy_count>0 && has_datagram_limit(dr)) {
+    size_t size=sizeof(TLSRPT_OBJECT_ITEM)-1+tlsrpt_size_policy_type(policy_type);
+    if(policydomainname!=NULL) size+=tlsrpt_size_policy_domain(policydomainname, strlen(policydomainname));
+    if(exceeds_datagram_limit(dr, (long)size)) {
+      mark_truncated(dr);
+      dr->dropping_policy=1;
+      ++dr->dropped_policies;
+      return 0;
+    }
+  }
 
   if(dr->policy_count==0) {
-    res = fprintf(dr->memstream, ",\"policies\":[{");
+    res = TLSRPT_SERIALIZE_LITERAL(dr->memstream, TLSRPT_KEY_POLICIES TLSRPT_OBJECT_BEGIN);
   } else {
-    res = fprintf(dr->memstream, ",{");
+    res = TLSRPT_SERIALIZE_LITERAL(dr->memstream, TLSRPT_OBJECT_ITEM);
   }
   if(res<0) return errorcode(dr, TLSRPT_ERR_FPRINTF_INITPOLICY+errno);
 
-  res = fprintf(dr->memstream, "\"policy-type\":%d", dr->policy_type);
-  if(res<0) return errorcode(dr, TLSRPT_ERR_FPRINTF_INITPOLICY+errno);
-  res=write_attribute_if_not_null(dr->memstream, "policy-domain", policydomainname);
+  if(policy_type==TLSRPT_NO_POLICY_FOUND) {
+    /* fast path for the most common policy type */
+    res = TLSRPT_SERIALIZE_LITERAL(dr->memstream, TLSRPT_ATTR_POLICY_TYPE_NO_POLICY_FOUND);
+  } else {
+    res = tlsrpt_serialize_policy_type(dr->memstream, policy_type);
+  }
   if(res<0) return errorcode(dr, TLSRPT_ERR_FPRINTF_INITPOLICY+errno);
+  if(policydomainname!=NULL) {
+    /* like the domain, the policy domain identifies the policy in the report and is never cut */
+    res=tlsrpt_serialize_policy_domain(dr->memstream, policydomainname, strlen(policydomainname));
+    if(res<0) return errorcode(dr, TLSRPT_ERR_FPRINTF_INITPOLICY+errno);
+  }
+
+  /* the sub-memstreams are opened when the first detail is added */
+  dr->policy_type=policy_type;
+  dr->in_policy=1;
   ++dr->policy_count;
 
   return 0;
@@ -343,17 +884,20 @@ int tlsrpt_add_policy_string(struct tlsrpt_dr_t* dr, const char* policy_string)
   int res=0;
 
   RETURN_ON_EXISTING_ERRORS;
+  if(dr->dropping_policy) return 0;
+  if(!dr->in_policy) return errorcode(dr, TLSRPT_ERR_TLSRPT_NOTINPOLICY);
 
-  res=fprintf(dr->memstreamps,"%s\"",dr->separatorps);
-  if(res<0) return errorcode(dr, TLSRPT_ERR_FPRINTF_ADDPOLICYSTRING+errno);
-
-  res=json_escape(dr->memstreamps,policy_string);
-  if(res<0) return errorcode(dr, TLSRPT_ERR_FPRINTF_ADDPOLICYSTRING+errno);
-
-  res=fprintf(dr->memstreamps,"\"");
+  size_t length=field_length(policy_string, dr->con->limits[TLSRPT_LIMIT_BYTES_PER_FIELD]);
+  if(has_datagram_limit(dr) && exceeds_datagram_limit(dr, (long)tlsrpt_size_policy_strings_item(dr->firstps, policy_string, length))) {
+    mark_truncated(dr);
+    return 0;
+  }
+  if(sub_memstream(&dr->memstreamps, &dr->memstreambufferps, &dr->memstreamsizeps)==NULL) return errorcode(dr, TLSRPT_ERR_OPEN_MEMSTREAM_INITPOLICY+errno);
+  res=tlsrpt_serialize_policy_strings_item(dr->memstreamps, dr->firstps, policy_string, length);
   if(res<0) return errorcode(dr, TLSRPT_ERR_FPRINTF_ADDPOLICYSTRING+errno);
 
-  dr->separatorps=",";
+  if(policy_string[length]!=0) mark_truncated(dr);
+  dr->firstps=0;
   return 0;
 }
 
@@ -361,20 +905,36 @@ int tlsrpt_add_mx_host_pattern(struct tlsrpt_dr_t* dr, const char* mx_host_patte
   int res=0;
 
   RETURN_ON_EXISTING_ERRORS;
+  if(dr->dropping_policy) return 0;
+  if(!dr->in_policy) return errorcode(dr, TLSRPT_ERR_TLSRPT_NOTINPOLICY);
 
-  res=fprintf(dr->memstreammx,"%s\"",dr->separatormx);
-  if(res<0) return errorcode(dr, TLSRPT_ERR_FPRINTF_ADDMXHOSTPATTERN+errno);
-
-  res=json_escape(dr->memstreammx,mx_host_pattern);
-  if(res<0) return errorcode(dr, TLSRPT_ERR_FPRINTF_ADDMXHOSTPATTERN+errno);
-
-  res=fprintf(dr->memstreammx,"\"");
+  size_t length=field_length(mx_host_pattern, dr->con->limits[TLSRPT_LIMIT_BYTES_PER_FIELD]);
+  if(has_datagram_limit(dr) && exceeds_datagram_limit(dr, (long)tlsrpt_size_mx_hosts_item(dr->firstmx, mx_host_pattern, length))) {
+    mark_truncated(dr);
+    return 0;
+  }
+  if(sub_memstream(&dr->memstreammx, &dr->memstreambuffermx, &dr->memstreamsizemx)==NULL) return errorcode(dr, TLSRPT_ERR_OPEN_MEMSTREAM_INITPOLICY+errno);
+  res=tlsrpt_serialize_mx_hosts_item(dr->memstreammx, dr->firstmx, mx_host_pattern, length);
   if(res<0) return errorcode(dr, TLSRPT_ERR_FPRINTF_ADDMXHOSTPATTERN+errno);
 
-  dr->separatormx=",";
+  if(mx_host_pattern[length]!=0) mark_truncated(dr);
+  dr->firstmx=0;
   return 0;
 }
 
+/* Closes and frees the sub-memstreams and the failure index without serializing their contents */
+static void release_sub_memstreams(tlsrpt_dr_t *dr) {
+  if(dr->memstreamps!=NULL) fclose(dr->memstreamps);
+  if(dr->memstreammx!=NULL) fclose(dr->memstreammx);
+  if(dr->memstreamfd!=NULL) fclose(dr->memstreamfd);
+  free(dr->memstreambufferps);
+  free(dr->memstreambuffermx);
+  free(dr->memstreambufferfd);
+  free(dr->failures);
+  free(dr->failure_index);
+  reset_sub_memstreams(dr);
+}
+
 int tlsrpt_finish_policy(struct tlsrpt_dr_t* dr, tlsrpt_final_result_t final_result) {
   int res=0;
   /*
@@ -382,34 +942,53 @@ Throughout this function the errorcode is never returned prematurely!
 We need to go through all steps of cleaning up!
 Calls to errorcode will record the errorcode in the tlsrpt_dr_t structure.
    */
+  if(dr->dropping_policy) {
+    /* nothing of a dropped policy was serialized, but whatever is still open must be released */
+    release_sub_memstreams(dr);
+    dr->dropping_policy=0;
+    return dr->status;
+  }
+  if(!dr->in_policy) errorcode(dr, TLSRPT_ERR_TLSRPT_NOTINPOLICY);
+  /* sub-memstreams only exist if details were added */
   if(dr->memstreamps!=NULL) {
     res=fclose(dr->memstreamps);
     if(res!=0) errorcode(dr, TLSRPT_ERR_FCLOSE_FINISHPOLICY+errno);
-  } else {
-    errorcode(dr,TLSRPT_ERR_TLSRPT_MEMSTREAMPS_NOT_INITIALIZED);
   }
   if(dr->memstreammx!=NULL) {
     res=fclose(dr->memstreammx);
     if(res!=0) errorcode(dr, TLSRPT_ERR_FCLOSE_FINISHPOLICY+errno);
-  } else {
-    errorcode(dr,TLSRPT_ERR_TLSRPT_MEMSTREAMMX_NOT_INITIALIZED);
   }
   if(dr->memstreamfd!=NULL) {
     res=fclose(dr->memstreamfd);
     if(res!=0) errorcode(dr, TLSRPT_ERR_FCLOSE_FINISHPOLICY+errno);
-  } else {
-    errorcode(dr,TLSRPT_ERR_TLSRPT_MEMSTREAMFD_NOT_INITIALIZED);
   }
 
   if(dr->memstream!=NULL) {
-    if(dr->memstreamsizeps>0) res = fprintf(dr->memstream, ",\"policy-string\":[%s]", dr->memstreambufferps);
-    if(res<0) return errorcode(dr, TLSRPT_ERR_FPRINTF_FINISHPOLICY+errno);
-    if(dr->memstreamsizemx>0) res = fprintf(dr->memstream, ",\"mx-host\":[%s]", dr->memstreambuffermx);
-    if(res<0) return errorcode(dr, TLSRPT_ERR_FPRINTF_FINISHPOLICY+errno);
-    if(dr->memstreamsizefd>0) res = fprintf(dr->memstream, ",\"failure-details\":[%s]", dr->memstreambufferfd);
-    if(res<0) return errorcode(dr, TLSRPT_ERR_FPRINTF_FINISHPOLICY+errno);
-
-    res=fprintf(dr->memstream, ",\"t\":%d,\"f\":%d}", dr->failure_count, final_result);
+    if(dr->memstreamsizeps>0) {
+      res=tlsrpt_serialize_policy_strings_begin(dr->memstream);
+      if(res<0 || fwrite(dr->memstreambufferps, 1, dr->memstreamsizeps, dr->memstream)!=dr->memstreamsizeps || TLSRPT_SERIALIZE_LITERAL(dr->memstream, TLSRPT_LIST_END)<0) return errorcode(dr, TLSRPT_ERR_FPRINTF_FINISHPOLICY+errno);
+    }
+    if(dr->memstreamsizemx>0) {
+      res=tlsrpt_serialize_mx_hosts_begin(dr->memstream);
+      if(res<0 || fwrite(dr->memstreambuffermx, 1, dr->memstreamsizemx, dr->memstream)!=dr->memstreamsizemx || TLSRPT_SERIALIZE_LITERAL(dr->memstream, TLSRPT_LIST_END)<0) return errorcode(dr, TLSRPT_ERR_FPRINTF_FINISHPOLICY+errno);
+    }
+    if(dr->failures_used>0) {
+      res=write_failure_details(dr->memstream, dr->failures, dr->failures_used, dr->memstreambufferfd);
+      if(res<0) return errorcode(dr, TLSRPT_ERR_FPRINTF_FINISHPOLICY+errno);
+    }
+
+    if(dr->policy_truncated) {
+      res=TLSRPT_SERIALIZE_LITERAL(dr->memstream, TLSRPT_ATTR_TRUNCATED);
+      if(res<0) return errorcode(dr, TLSRPT_ERR_FPRINTF_FINISHPOLICY+errno);
+    }
+    if(dr->failure_count==0 && final_result==TLSRPT_FINAL_SUCCESS) {
+      /* fast path for the most common result */
+      res=TLSRPT_SERIALIZE_LITERAL(dr->memstream, TLSRPT_ATTR_FAILURE_COUNT_NONE TLSRPT_ATTR_FINAL_RESULT_SUCCESS TLSRPT_OBJECT_END);
+    } else {
+      res=tlsrpt_serialize_failure_count(dr->memstream, dr->failure_count);
+      if(res==0) res=tlsrpt_serialize_final_result(dr->memstream, final_result);
+      if(res==0) res=TLSRPT_SERIALIZE_LITERAL(dr->memstream, TLSRPT_OBJECT_END);
+    }
     if(res<0) return errorcode(dr, TLSRPT_ERR_FPRINTF_FINISHPOLICY+errno);
   } else {
     errorcode(dr,TLSRPT_ERR_TLSRPT_MEMSTREAM_NOT_INITIALIZED);
@@ -418,6 +997,8 @@ Calls to errorcode will record the errorcode in the tlsrpt_dr_t structure.
   free(dr->memstreambufferps);
   free(dr->memstreambuffermx);
   free(dr->memstreambufferfd);
+  free(dr->failures);
+  free(dr->failure_index);
   reset_sub_memstreams(dr);
   return dr->status; /* errorcode of first error that has occured or zero when no error hapened */
 }
@@ -434,34 +1015,298 @@ int tlsrpt_add_delivery_request_failure(struct tlsrpt_dr_t* dr, tlsrpt_failure_t
 
   RETURN_ON_EXISTING_ERRORS;
 
+  if(dr->dropping_policy) {
+    dr->dropped_failures+=1;
+    return 0;
+  }
+  if(!dr->in_policy) return errorcode(dr, TLSRPT_ERR_TLSRPT_NOTINPOLICY);
+
+  const char *fields[FAILURE_FIELDS]={sending_mta_ip, receiving_mx_hostname, receiving_mx_helo, receiving_ip, additional_information, failure_reason_code};
+  for(int i=0; i<FAILURE_FIELDS; ++i) {
+    if(fields[i]!=TLSRPT_USE_DEFAULT) continue;
+    fields[i]=dr->con->failuredefaults[i].value;
+    if(fields[i]==NULL) return errorcode(dr, TLSRPT_ERR_TLSRPT_NODEFAULT);
+  }
   dr->failure_count+=1;
 
-  res=fprintf(dr->memstreamfd,"%s",dr->separatorfd);
-  if(res<0) return errorcode(dr, TLSRPT_ERR_FPRINTF_ADDFAILURE+errno);
-  res=fprintf(dr->memstreamfd,"{");
-  if(res<0) return errorcode(dr, TLSRPT_ERR_FPRINTF_ADDFAILURE+errno);
-  res=write_failure_code(dr->memstreamfd, "c", failure_code);
-  if(res<0) return errorcode(dr, TLSRPT_ERR_FPRINTF_ADDFAILURE+errno);
+  /* With deduplication an identical failure within this policy only increments the count of the already rendered failure detail */
+  size_t fieldlimit=dr->con->limits[TLSRPT_LIMIT_BYTES_PER_FIELD];
+  unsigned long long hash=FNV_OFFSET_BASIS;
+  hash=hash_field(hash, (const char*)&failure_code, sizeof(failure_code));
+  for(int i=0; i<FAILURE_FIELDS; ++i) {
+    /* failures differing only beyond the field limit are identical, default values are never cut */
+    if(fields[i]==NULL || fields[i]==dr->con->failuredefaults[i].value) {
+      hash=hash_string_field(hash, fields[i]);
+    } else {
+      hash=hash_string_prefix(hash, fields[i], field_length(fields[i], fieldlimit));
+    }
+  }
 
-  res=write_attribute_if_not_null(dr->memstreamfd, "s", sending_mta_ip);
-  if(res<0) return errorcode(dr, TLSRPT_ERR_FPRINTF_ADDFAILURE+errno);
-  res=write_attribute_if_not_null(dr->memstreamfd, "n", receiving_mx_hostname);
-  if(res<0) return errorcode(dr, TLSRPT_ERR_FPRINTF_ADDFAILURE+errno);
-  res=write_attribute_if_not_null(dr->memstreamfd, "h", receiving_mx_helo);
-  if(res<0) return errorcode(dr, TLSRPT_ERR_FPRINTF_ADDFAILURE+errno);
-  res=write_attribute_if_not_null(dr->memstreamfd, "r", receiving_ip);
-  if(res<0) return errorcode(dr, TLSRPT_ERR_FPRINTF_ADDFAILURE+errno);
-  res=write_attribute_if_not_null(dr->memstreamfd, "a", additional_information);
-  if(res<0) return errorcode(dr, TLSRPT_ERR_FPRINTF_ADDFAILURE+errno);
-  res=write_attribute_if_not_null(dr->memstreamfd, "f", failure_reason_code);
-  if(res<0) return errorcode(dr, TLSRPT_ERR_FPRINTF_ADDFAILURE+errno);
+  /* without deduplication the index is not used, identical failures would only make its probe sequences long */
+  int deduplicate=dr->con->deduplicate;
+  int mask=dr->failure_index_size-1;
+  int slot=(int)(hash & mask);
+  for(; deduplicate && dr->failure_index_size>0 && dr->failure_index[slot]!=0; slot=(slot+1) & mask) {
+    tlsrpt_failure_entry_t *entry=&dr->failures[dr->failure_index[slot]-1];
+    if(entry->hash!=hash) continue;
+    /* make the rendered failure details accessible in memstreambufferfd */
+    res=fflush(dr->memstreamfd);
+    if(res!=0) return errorcode(dr, TLSRPT_ERR_FPRINTF_ADDFAILURE+errno);
+    if(failure_matches(dr->memstreambufferfd+entry->offset, entry->length, dr->con, failure_code, fields)) {
+      entry->count+=1;
+      return 0;
+    }
+  }
 
-  res=fprintf(dr->memstreamfd,"}");
+  /* A new distinct failure is only counted in "t" beyond the failures limit */
+  size_t maxfailures=dr->con->limits[TLSRPT_LIMIT_FAILURES_PER_POLICY];
+  if(maxfailures>0 && (size_t)dr->failures_used>=maxfailures) {
+    mark_truncated(dr);
+    return 0;
+  }
+  /* a new distinct failure that would exceed the datagram limit is only counted in "t" as well */
+  if(has_datagram_limit(dr) && exceeds_datagram_limit(dr, (long)(failure_size(dr->con, failure_code, fields, fieldlimit)+FAILURE_OVERHEAD))) {
+    mark_truncated(dr);
+    return 0;
+  }
+
+  /* keep the index at most half full */
+  if(dr->failures_used==dr->failures_alloc) {
+    int alloc=dr->failures_alloc>0 ? dr->failures_alloc*2 : 8;
+    tlsrpt_failure_entry_t *failures=realloc(dr->failures, alloc*sizeof(tlsrpt_failure_entry_t));
+    if(failures==NULL) return errorcode(dr, TLSRPT_ERR_MALLOC_ADDFAILURE+errno);
+    dr->failures=failures;
+    dr->failures_alloc=alloc;
+  }
+  if(deduplicate && (dr->failures_used+1)*2>dr->failure_index_size) {
+    /* the failures added before deduplication was enabled are indexed as well */
+    int indexsize=dr->failure_index_size>0 ? dr->failure_index_size*2 : 16;
+    while(indexsize<(dr->failures_used+1)*2) indexsize*=2;
+    if(rebuild_failure_index(dr, indexsize)!=0) return errorcode(dr, TLSRPT_ERR_MALLOC_ADDFAILURE+errno);
+    mask=dr->failure_index_size-1;
+    for(slot=(int)(hash & mask); dr->failure_index[slot]!=0; slot=(slot+1) & mask);
+  }
+  if(sub_memstream(&dr->memstreamfd, &dr->memstreambufferfd, &dr->memstreamsizefd)==NULL) return errorcode(dr, TLSRPT_ERR_OPEN_MEMSTREAM_INITPOLICY+errno);
+  tlsrpt_failure_entry_t *entry=&dr->failures[dr->failures_used];
+  entry->hash=hash;
+  entry->count=1;
+  entry->offset=ftell(dr->memstreamfd);
+  if(entry->offset<0) return errorcode(dr, TLSRPT_ERR_FPRINTF_ADDFAILURE+errno);
+
+  res=tlsrpt_serialize_failure_code(dr->memstreamfd, failure_code);
   if(res<0) return errorcode(dr, TLSRPT_ERR_FPRINTF_ADDFAILURE+errno);
-  dr->separatorfd=",";
+
+  for(int i=0; i<FAILURE_FIELDS; ++i) {
+    if(fields[i]!=NULL && fields[i]==dr->con->failuredefaults[i].value) {
+      /* splice in the pre-escaped default value */
+      if(fwrite(dr->con->failuredefaults[i].rendered, 1, dr->con->failuredefaults[i].renderedsize, dr->memstreamfd)!=dr->con->failuredefaults[i].renderedsize) {
+	return errorcode(dr, TLSRPT_ERR_FPRINTF_ADDFAILURE+errno);
+      }
+    } else {
+      res=write_failure_field_if_not_null(dr->memstreamfd, i, fields[i], fieldlimit);
+      if(res<0) return errorcode(dr, TLSRPT_ERR_FPRINTF_ADDFAILURE+errno);
+      if(res>0) mark_truncated(dr);
+    }
+  }
+
+  long end=ftell(dr->memstreamfd);
+  if(end<0) return errorcode(dr, TLSRPT_ERR_FPRINTF_ADDFAILURE+errno);
+  entry->length=end-entry->offset;
+  dr->failures_used+=1;
+  if(deduplicate) dr->failure_index[slot]=dr->failures_used;
   return 0;
 }
 
+/* Appends a memory block to the export blob */
+static char* export_block(char* p, const void* data, size_t size) {
+  if(size>0) memcpy(p, data, size);
+  return p+size;
+}
+
+int tlsrpt_export_delivery_request(struct tlsrpt_dr_t* dr, char** pbuf, size_t* psize) {
+  *pbuf=NULL;
+  *psize=0;
+
+  RETURN_ON_EXISTING_ERRORS;
+
+  /* make the current contents of the memstreams accessible in their buffers */
+  int in_policy=dr->in_policy;
+  if(fflush(dr->memstream)!=0) return TLSRPT_ERR_FFLUSH_EXPORTDR+errno;
+  if(dr->memstreamps!=NULL && fflush(dr->memstreamps)!=0) return TLSRPT_ERR_FFLUSH_EXPORTDR+errno;
+  if(dr->memstreammx!=NULL && fflush(dr->memstreammx)!=0) return TLSRPT_ERR_FFLUSH_EXPORTDR+errno;
+  if(dr->memstreamfd!=NULL && fflush(dr->memstreamfd)!=0) return TLSRPT_ERR_FFLUSH_EXPORTDR+errno;
+
+  tlsrpt_export_header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, EXPORT_MAGIC, sizeof(header.magic));
+  header.domainhash=dr->domainhash;
+  header.mainsize=dr->memstreamsize;
+  if(in_policy) {
+    header.pssize=dr->memstreamsizeps;
+    header.mxsize=dr->memstreamsizemx;
+    header.fdsize=dr->memstreamsizefd;
+    header.failures_used=dr->failures_used;
+  }
+  header.failure_count=dr->failure_count;
+  header.policy_count=dr->policy_count;
+  header.policy_type=dr->policy_type;
+  header.in_policy=in_policy;
+  header.truncated=dr->truncated;
+  header.policy_truncated=dr->policy_truncated;
+  header.dropping_policy=dr->dropping_policy;
+  header.dropped_policies=dr->dropped_policies;
+  header.dropped_failures=dr->dropped_failures;
+
+  size_t size=sizeof(header)+header.failures_used*sizeof(tlsrpt_export_failure_t)+header.mainsize+header.pssize+header.mxsize+header.fdsize;
+  char *buf=malloc(size);
+  if(buf==NULL) return TLSRPT_ERR_MALLOC_EXPORTDR+errno;
+  char *p=export_block(buf, &header, sizeof(header));
+  for(int i=0; i<header.failures_used; ++i) {
+    tlsrpt_export_failure_t failure;
+    memset(&failure, 0, sizeof(failure));
+    failure.hash=dr->failures[i].hash;
+    failure.offset=dr->failures[i].offset;
+    failure.length=dr->failures[i].length;
+    failure.count=dr->failures[i].count;
+    p=export_block(p, &failure, sizeof(failure));
+  }
+  p=export_block(p, dr->memstreambuffer, header.mainsize);
+  if(in_policy) {
+    p=export_block(p, dr->memstreambufferps, header.pssize);
+    p=export_block(p, dr->memstreambuffermx, header.mxsize);
+    p=export_block(p, dr->memstreambufferfd, header.fdsize);
+  }
+  *pbuf=buf;
+  *psize=size;
+  return 0;
+}
+
+/* Opens a memstream with the given initial contents */
+static FILE* import_memstream(char** pbuffer, size_t* psize, const char* data, size_t size) {
+  FILE *memstream=open_memstream(pbuffer, psize);
+  if(memstream==NULL) return NULL;
+  if(size>0 && fwrite(data, 1, size, memstream)!=size) {
+    fclose(memstream);
+    free(*pbuffer);
+    *pbuffer=NULL;
+    return NULL;
+  }
+  return memstream;
+}
+
+/* Restores the state of an exported delivery request into a freshly allocated tlsrpt_dr_t */
+static int tlsrpt_import_delivery_request_prepare_struct(tlsrpt_dr_t *dr, const tlsrpt_export_header_t* header, const char* data) {
+  const char *ps=data+header->failures_used*sizeof(tlsrpt_export_failure_t)+header->mainsize;
+  const char *mx=ps+header->pssize;
+  const char *fd=mx+header->mxsize;
+
+  if(!header->in_policy) return 0;
+  dr->in_policy=1;
+
+  /* like in the exporting process, only sub-memstreams with contents are opened */
+  if(header->pssize>0) {
+    dr->memstreamps=import_memstream(&dr->memstreambufferps, &dr->memstreamsizeps, ps, header->pssize);
+    if(dr->memstreamps==NULL) return errorcode(dr, TLSRPT_ERR_OPEN_MEMSTREAM_IMPORTDR+errno);
+    dr->firstps=0;
+  }
+  if(header->mxsize>0) {
+    dr->memstreammx=import_memstream(&dr->memstreambuffermx, &dr->memstreamsizemx, mx, header->mxsize);
+    if(dr->memstreammx==NULL) return errorcode(dr, TLSRPT_ERR_OPEN_MEMSTREAM_IMPORTDR+errno);
+    dr->firstmx=0;
+  }
+  if(header->fdsize>0) {
+    dr->memstreamfd=import_memstream(&dr->memstreambufferfd, &dr->memstreamsizefd, fd, header->fdsize);
+    if(dr->memstreamfd==NULL) return errorcode(dr, TLSRPT_ERR_OPEN_MEMSTREAM_IMPORTDR+errno);
+  }
+
+  if(header->failures_used>0) {
+    dr->failures=malloc(header->failures_used*sizeof(tlsrpt_failure_entry_t));
+    if(dr->failures==NULL) return errorcode(dr, TLSRPT_ERR_MALLOC_IMPORTDR+errno);
+    dr->failures_alloc=header->failures_used;
+    for(int i=0; i<header->failures_used; ++i) {
+      tlsrpt_export_failure_t failure;
+      memcpy(&failure, data+i*sizeof(failure), sizeof(failure));
+      dr->failures[i].hash=failure.hash;
+      dr->failures[i].offset=failure.offset;
+      dr->failures[i].length=failure.length;
+      dr->failures[i].count=failure.count;
+    }
+    dr->failures_used=header->failures_used;
+    int indexsize=16;
+    while(indexsize<dr->failures_used*2) indexsize*=2;
+    if(rebuild_failure_index(dr, indexsize)!=0) return errorcode(dr, TLSRPT_ERR_MALLOC_IMPORTDR+errno);
+  }
+  return 0;
+}
+
+/* Checks a flag of an exported delivery request */
+static int is_flag(int32_t value) {
+  return value==0 || value==1;
+}
+
+int tlsrpt_import_delivery_request(struct tlsrpt_dr_t** pdr, struct tlsrpt_connection_t* con, const char* buf, size_t size) {
+  *pdr=NULL;
+
+  /* check the blob before trusting any of its sizes */
+  tlsrpt_export_header_t header;
+  if(size<sizeof(header)) return TLSRPT_ERR_TLSRPT_INVALIDEXPORT;
+  memcpy(&header, buf, sizeof(header));
+  if(memcmp(header.magic, EXPORT_MAGIC, sizeof(header.magic))!=0) return TLSRPT_ERR_TLSRPT_INVALIDEXPORT;
+  if(!is_flag(header.in_policy) || !is_flag(header.dropping_policy) || !is_flag(header.truncated) || !is_flag(header.policy_truncated)) return TLSRPT_ERR_TLSRPT_INVALIDEXPORT;
+  if(header.in_policy && header.dropping_policy) return TLSRPT_ERR_TLSRPT_INVALIDEXPORT;
+  if(header.failure_count<0 || header.policy_count<0 || header.dropped_policies<0 || header.dropped_failures<0) return TLSRPT_ERR_TLSRPT_INVALIDEXPORT;
+  if(header.failures_used<0 || (header.failures_used>0 && !header.in_policy)) return TLSRPT_ERR_TLSRPT_INVALIDEXPORT;
+  uint64_t payload=size-sizeof(header);
+  uint64_t blocks[]={header.failures_used*sizeof(tlsrpt_export_failure_t), header.mainsize, header.pssize, header.mxsize, header.fdsize};
+  for(size_t i=0; i<sizeof(blocks)/sizeof(blocks[0]); ++i) {
+    if(blocks[i]>payload) return TLSRPT_ERR_TLSRPT_INVALIDEXPORT;
+    payload-=blocks[i];
+  }
+  if(payload!=0 || header.mainsize==0) return TLSRPT_ERR_TLSRPT_INVALIDEXPORT;
+  const char *data=buf+sizeof(header);
+  for(int i=0; i<header.failures_used; ++i) {
+    tlsrpt_export_failure_t failure;
+    memcpy(&failure, data+i*sizeof(failure), sizeof(failure));
+    if(failure.offset<0 || (uint64_t)failure.offset>header.fdsize) return TLSRPT_ERR_TLSRPT_INVALIDEXPORT;
+    if(failure.length<0 || (uint64_t)failure.length>header.fdsize-(uint64_t)failure.offset) return TLSRPT_ERR_TLSRPT_INVALIDEXPORT;
+  }
+
+  struct tlsrpt_dr_t* ptr=(struct tlsrpt_dr_t*)tlsrpt_malloc(sizeof(struct tlsrpt_dr_t));
+  if(ptr==NULL) return TLSRPT_ERR_MALLOC_IMPORTDR+errno;
+  ptr->status=0;
+  ptr->con=con;
+  reset_sub_memstreams(ptr);
+  ptr->domainhash=header.domainhash;
+  ptr->failure_count=header.failure_count;
+  ptr->policy_count=header.policy_count;
+  ptr->policy_type=header.policy_type;
+  ptr->truncated=header.truncated;
+  ptr->policy_truncated=header.policy_truncated;
+  ptr->dropping_policy=header.dropping_policy;
+  ptr->dropped_policies=header.dropped_policies;
+  ptr->dropped_failures=header.dropped_failures;
+
+  /* main memstream, without it the delivery request can not even be cancelled */
+  ptr->memstreambuffer=NULL;
+  ptr->memstreamsize=0;
+  ptr->memstream=import_memstream(&ptr->memstreambuffer, &ptr->memstreamsize, data+header.failures_used*sizeof(tlsrpt_export_failure_t), header.mainsize);
+  if(ptr->memstream==NULL) {
+    int res=TLSRPT_ERR_OPEN_MEMSTREAM_IMPORTDR+errno;
+    tlsrpt_free(ptr);
+    return res;
+  }
+  if(con==NULL) errorcode(ptr, TLSRPT_ERR_TLSRPT_NOCONNECTION);
+
+  int res=(ptr->status!=0)?ptr->status:tlsrpt_import_delivery_request_prepare_struct(ptr, &header, data);
+  if(res==0) {
+    *pdr=ptr;
+    return 0;
+  }
+  // clean up
+  tlsrpt_cancel_delivery_request(&ptr);
+  return res;
+}
+
 /*
  The sending datagram socket is set to non-blocking in normal operation.
 But for debugging and benchmarking purposes it might be useful to set it to blocking.
@@ -482,6 +1327,508 @@ int tlsrpt_get_socket(tlsrpt_connection_t* con) {
   return con->sock_fd;
 }
 
+/* Records the current send queue depth as new high-water mark if it exceeds the previous one */
+static int sample_send_queue(tlsrpt_connection_t* con, int* queued) {
+  if(ioctl(con->sock_fd, SIOCOUTQ, queued)!=0) return -1;
+  int highwater=__atomic_load_n(&con->queuehighwater, __ATOMIC_RELAXED);
+  while(*queued>highwater && !__atomic_compare_exchange_n(&con->queuehighwater, &highwater, *queued, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return 0;
+}
+
+/* Doubles SO_SNDBUF up to the configured maximum, returns 1 if the send buffer was grown */
+static int grow_sndbuf(tlsrpt_connection_t* con) {
+  int sndbufmax=__atomic_load_n(&con->sndbufmax, __ATOMIC_RELAXED);
+  int sndbuf=__atomic_load_n(&con->sndbuf, __ATOMIC_RELAXED);
+  if(sndbuf==0) {
+    /* the kernel reports the doubled value including its bookkeeping overhead */
+    socklen_t len=sizeof(sndbuf);
+    if(getsockopt(con->sock_fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len)!=0) return 0;
+    sndbuf/=2;
+  }
+  if(sndbuf>=sndbufmax) return 0;
+  int grown=(sndbuf>sndbufmax/2)?sndbufmax:sndbuf*2;
+  if(setsockopt(con->sock_fd, SOL_SOCKET, SO_SNDBUF, &grown, sizeof(grown))!=0) return 0;
+  __atomic_store_n(&con->sndbuf, grown, __ATOMIC_RELAXED);
+  return 1;
+}
+
+/* Appends a datagram to the capture ring, concurrent writers reserve their space lock-free */
+static void capture_datagram(tlsrpt_connection_t* con, const char* data, size_t size) {
+  tlsrpt_capture_header_t *capture=con->capture;
+  if(__atomic_fetch_add(&con->capturecounter, 1, __ATOMIC_RELAXED) % con->capturerate != 0) return;
+  uint64_t needed=sizeof(tlsrpt_capture_record_t)+CAPTURE_ALIGN(size);
+  if(needed>capture->capacity) return;
+  uint64_t start;
+  uint64_t head=__atomic_load_n(&capture->head, __ATOMIC_RELAXED);
+  do {
+    start=(head+needed>capture->capacity)?0:head; /* wrap around, overwriting the oldest records */
+  } while(!__atomic_compare_exchange_n(&capture->head, &head, start+needed, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  if(start==0 && head!=0) {
+    __atomic_store_n(&capture->lapend, head, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&capture->lap, 1, __ATOMIC_RELAXED);
+  }
+
+  tlsrpt_capture_record_t *record=(tlsrpt_capture_record_t*)((char*)(capture+1)+start);
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  __atomic_store_n(&record->magic, 0, __ATOMIC_RELAXED);
+  record->length=size;
+  record->timestamp=(uint64_t)now.tv_sec*1000000000+now.tv_nsec;
+  memcpy(record+1, data, size);
+  __atomic_store_n(&record->magic, CAPTURE_RECORD_MAGIC, __ATOMIC_RELEASE);
+}
+
+static long monotonic_seconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec;
+}
+
+/* Mixes the domain hash with the shard seed for rendezvous hashing */
+static unsigned long long shard_score(unsigned long long domainhash, unsigned long long seed) {
+  unsigned long long x=domainhash^seed;
+  x=(x^(x>>30))*0xbf58476d1ce4e5b9ULL;
+  x=(x^(x>>27))*0x94d049bb133111ebULL;
+  return x^(x>>31);
+}
+
+/* Selects the live shard with the highest score for the domain, so each domain sticks to one shard and only the domains of a dead shard move */
+static int select_shard(tlsrpt_connection_t* con, unsigned long long domainhash) {
+  if(con->shardcount==1) return 0;
+  long now=monotonic_seconds();
+  int best=-1;
+  int bestany=0;
+  unsigned long long bestscore=0;
+  unsigned long long bestanyscore=0;
+  for(int i=0; i<con->shardcount; ++i) {
+    unsigned long long score=shard_score(domainhash, con->shards[i].seed);
+    if(score>=bestanyscore) {
+      bestany=i;
+      bestanyscore=score;
+    }
+    if(__atomic_load_n(&con->shards[i].deaduntil, __ATOMIC_RELAXED)>now) continue;
+    if(best<0 || score>bestscore) {
+      best=i;
+      bestscore=score;
+    }
+  }
+  /* if all shards are dead try the preferred one anyway */
+  return (best>=0)?best:bestany;
+}
+
+/* Sends one datagram to a shard, returns the result of sendto with errno set on failure */
+static ssize_t send_to_shard(tlsrpt_connection_t* con, const tlsrpt_shard_t* shard, const char* data, size_t size) {
+  ssize_t res = sendto(con->sock_fd, data, size, tlsrpt_sendto_flags,
+		       (const struct sockaddr *) &shard->addr, sizeof(struct sockaddr_un));
+  if(res<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) {
+    int err=errno;
+    int queued=0;
+    sample_send_queue(con, &queued);
+    /* retry once with a larger send buffer if adaptive sizing is enabled, its errno tells why the retry failed */
+    if(__atomic_load_n(&con->sndbufmax, __ATOMIC_RELAXED)>0 && grow_sndbuf(con)) {
+      res = sendto(con->sock_fd, data, size, tlsrpt_sendto_flags,
+		   (const struct sockaddr *) &shard->addr, sizeof(struct sockaddr_un));
+    } else {
+      errno=err; /* the ioctl and setsockopt calls may have changed errno */
+    }
+  }
+  if(res>=0 && __atomic_fetch_add(&con->sendcounter, 1, __ATOMIC_RELAXED)%QUEUE_SAMPLE_INTERVAL==0) {
+    /* the queue also builds up without ever blocking, sample it after successful sends as well */
+    int queued=0;
+    sample_send_queue(con, &queued);
+  }
+  return res;
+}
+
+/* Sink sending the datagram to the socket of the TLSRPT collectd of a shard, a socket nobody is listening on marks the shard dead */
+static int sink_socket(tlsrpt_connection_t* con, int shard, char** pdata, size_t size, int errorblock) {
+  if(send_to_shard(con, &con->shards[shard], *pdata, size)>=0) return 0;
+  int err=errno;
+  if(err==ECONNREFUSED || err==ENOENT) {
+    /* skip the shard for a while, select_shard moves its domains to the shard with their next highest score */
+    __atomic_store_n(&con->shards[shard].deaduntil, monotonic_seconds()+SHARD_RETRY_SECONDS, __ATOMIC_RELAXED);
+  }
+  return errorblock+err;
+}
+
+/* Sink writing the datagram as one line to a file descriptor, JSON datagrams never contain a raw newline */
+static int sink_fd(tlsrpt_connection_t* con, int shard, char** pdata, size_t size, int errorblock) {
+  struct iovec iov[2]={{*pdata, size}, {"\n", 1}};
+  ssize_t res=writev(con->sinkfd, iov, 2);
+  if(res<0) return TLSRPT_ERR_WRITEV+errno;
+  /* a partially written line is an error as well, there is no errno for it */
+  if((size_t)res!=size+1) return TLSRPT_ERR_WRITEV;
+  return 0;
+}
+
+/* Sink handing the datagram over to the application, which takes ownership of the buffer */
+static int sink_callback(tlsrpt_connection_t* con, int shard, char** pdata, size_t size, int errorblock) {
+  char *datagram=*pdata;
+  *pdata=NULL;
+  if(con->sinkcallback(con->sinkctx, datagram, size)!=0) return TLSRPT_ERR_TLSRPT_CALLBACKFAILED;
+  return 0;
+}
+
+/* Checks if a sink result means that the socket of the shard is gone and the shard was marked dead */
+static int shard_gone(int res, int errorblock) {
+  return res==errorblock+ECONNREFUSED || res==errorblock+ENOENT;
+}
+
+static int shard_dead(tlsrpt_connection_t* con, int shard) {
+  return __atomic_load_n(&con->shards[shard].deaduntil, __ATOMIC_RELAXED)>monotonic_seconds();
+}
+
+/* Emits the datagram of one delivery request to the shard of its domain, *pdata is set to NULL if the sink took ownership.
+   If the shard is gone the datagram goes to the shard select_shard picks for the domain now, where the later delivery requests of the domain will go as well */
+static int emit_datagram(tlsrpt_connection_t* con, unsigned long long domainhash, char** pdata, size_t size, int errorblock) {
+  int shard=select_shard(con, domainhash);
+  if(con->capture!=NULL) capture_datagram(con, *pdata, size);
+  int res=con->sink(con, shard, pdata, size, errorblock);
+  for(int tries=1; tries<con->shardcount && shard_gone(res, errorblock); ++tries) {
+    shard=select_shard(con, domainhash);
+    if(shard_dead(con, shard)) break; /* all shards are dead */
+    res=con->sink(con, shard, pdata, size, errorblock);
+  }
+  return res;
+}
+
+static int batch_append(tlsrpt_connection_t* con, int shard, unsigned long long domainhash, const char* data, size_t size);
+
+/* Moves the delivery requests of the batch of a dead shard into the batches of the shards their domains select now.
+   The dead shard is never selected, so its batchbuffer stays untouched while its records are moved */
+static int requeue_batch(tlsrpt_connection_t* con, int shard, int records, int error) {
+  tlsrpt_shard_t *batch=&con->shards[shard];
+  int res=0;
+  for(int i=0; i<records; ++i) {
+    const tlsrpt_batch_record_t *record=&batch->batchindex[i];
+    int target=select_shard(con, record->domainhash);
+    int recordres=error; /* the record is lost if all shards are dead */
+    if(!shard_dead(con, target)) recordres=batch_append(con, target, record->domainhash, batch->batchbuffer+record->offset, record->size);
+    if(res==0) res=recordres;
+  }
+  return res;
+}
+
+/* Keeps the error of a batch flushed on behalf of the delivery requests finished earlier, the batch mutex must be locked by the caller */
+static void keep_batch_error(tlsrpt_connection_t* con, int error) {
+  if(con->batcherror==0) con->batcherror=error;
+}
+
+/* Returns and clears the error kept from earlier batches or otherwise returns the given error, the batch mutex must be locked by the caller */
+static int take_batch_error(tlsrpt_connection_t* con, int error) {
+  if(con->batcherror==0) return error;
+  error=con->batcherror;
+  con->batcherror=0;
+  return error;
+}
+
+/* Sends the current batch of a shard as one datagram and empties the batch, the batch mutex must be locked by the caller */
+static int flush_batch(tlsrpt_connection_t* con, int shard) {
+  tlsrpt_shard_t *batch=&con->shards[shard];
+  if(batch->batchrecords==0) return 0;
+  memcpy(batch->batchbuffer+batch->batchsize, BATCH_SUFFIX, strlen(BATCH_SUFFIX));
+  size_t size=batch->batchsize+strlen(BATCH_SUFFIX);
+  if(con->capture!=NULL) capture_datagram(con, batch->batchbuffer, size);
+  int res=con->sink(con, shard, &batch->batchbuffer, size, TLSRPT_ERR_SENDTO_FLUSH);
+  int records=batch->batchrecords;
+  batch->batchsize=0;
+  batch->batchrecords=0;
+  /* a batch mixes domains, so each record follows its own domain */
+  if(con->shardcount>1 && shard_gone(res, TLSRPT_ERR_SENDTO_FLUSH)) res=requeue_batch(con, shard, records, res);
+  return res;
+}
+
+/* Returns the milliseconds since the first record was added to the batch */
+static long batch_age(const tlsrpt_shard_t* batch) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec-batch->batchstart.tv_sec)*1000+(now.tv_nsec-batch->batchstart.tv_nsec)/1000000;
+}
+
+/* Adds a delivery request datagram to the batch of a shard, the batch mutex must be locked by the caller.
+   Only errors losing this delivery request are returned, a failed flush of the delivery requests before it is kept for the next flush */
+static int batch_append(tlsrpt_connection_t* con, int shard, unsigned long long domainhash, const char* data, size_t size) {
+  int res=0;
+  tlsrpt_shard_t *batch=&con->shards[shard];
+  /* make room if the batch can not take this delivery request and its separator */
+  if(batch->batchrecords>0 && batch->batchsize+1+size+strlen(BATCH_SUFFIX)>con->batchlimit) {
+    int flushres=flush_batch(con, shard);
+    if(flushres!=0) keep_batch_error(con, flushres);
+    if(shard_dead(con, shard)) {
+      /* the shard died while flushing, follow the domain to its new shard */
+      int target=select_shard(con, domainhash);
+      if(shard_dead(con, target)) return flushres; /* this delivery request is lost as well */
+      return batch_append(con, target, domainhash, data, size);
+    }
+  }
+  if(batch->batchrecords==0) {
+    memcpy(batch->batchbuffer, BATCH_PREFIX, strlen(BATCH_PREFIX));
+    batch->batchsize=strlen(BATCH_PREFIX);
+    clock_gettime(CLOCK_MONOTONIC, &batch->batchstart);
+  } else {
+    batch->batchbuffer[batch->batchsize++]=',';
+  }
+  tlsrpt_batch_record_t *record=&batch->batchindex[batch->batchrecords];
+  record->domainhash=domainhash;
+  record->offset=batch->batchsize;
+  record->size=size;
+  memcpy(batch->batchbuffer+batch->batchsize, data, size);
+  batch->batchsize+=size;
+  ++batch->batchrecords;
+  if(con->batchdelay>0 && batch_age(batch)>=con->batchdelay) {
+    /* the batch holds this delivery request as well as earlier ones */
+    res=flush_batch(con, shard);
+    if(res!=0) keep_batch_error(con, res);
+  }
+  return res;
+}
+
+/* Emits a finished delivery request datagram directly or adds it to the batch of the shard of its domain if batching is enabled */
+static int queue_datagram(tlsrpt_connection_t* con, unsigned long long domainhash, char** pdata, size_t size) {
+  /* connections without batching do not contend for the batch mutex */
+  if(__atomic_load_n(&con->batchlimit, __ATOMIC_RELAXED)==0) return emit_datagram(con, domainhash, pdata, size, TLSRPT_ERR_SENDTO);
+  pthread_mutex_lock(&con->batchmutex);
+  if(con->batchlimit==0 || con->sink==sink_callback || strlen(BATCH_PREFIX)+size+strlen(BATCH_SUFFIX)>con->batchlimit) {
+    /* batching is disabled, useless for the callback sink or this delivery request would not even fit into an empty batch */
+    pthread_mutex_unlock(&con->batchmutex);
+    return emit_datagram(con, domainhash, pdata, size, TLSRPT_ERR_SENDTO);
+  }
+  int res=batch_append(con, select_shard(con, domainhash), domainhash, *pdata, size);
+  pthread_mutex_unlock(&con->batchmutex);
+  return res;
+}
+
+int tlsrpt_set_batching(struct tlsrpt_connection_t* con, size_t max_datagram_size, int max_delay_ms) {
+  int res=tlsrpt_flush(con);
+  pthread_mutex_lock(&con->batchmutex);
+  for(int i=0; i<con->shardcount; ++i) {
+    free(con->shards[i].batchbuffer);
+    free(con->shards[i].batchindex);
+    con->shards[i].batchbuffer=NULL;
+    con->shards[i].batchindex=NULL;
+  }
+  __atomic_store_n(&con->batchlimit, 0, __ATOMIC_RELAXED);
+  if(max_datagram_size>BUFFER_SIZE) max_datagram_size=BUFFER_SIZE;
+  if(max_datagram_size>0) {
+    size_t maxrecords=max_datagram_size/MIN_DATAGRAM_SIZE+1;
+    int i;
+    for(i=0; i<con->shardcount; ++i) {
+      con->shards[i].batchbuffer=malloc(max_datagram_size);
+      con->shards[i].batchindex=malloc(maxrecords*sizeof(tlsrpt_batch_record_t));
+      if(con->shards[i].batchbuffer==NULL || con->shards[i].batchindex==NULL) break;
+    }
+    if(i<con->shardcount) {
+      if(res==0) res=TLSRPT_ERR_MALLOC_SETBATCHING+errno;
+      /* the shard that failed may have got one of its two buffers */
+      for(int j=0; j<=i; ++j) {
+	free(con->shards[j].batchbuffer);
+	free(con->shards[j].batchindex);
+	con->shards[j].batchbuffer=NULL;
+	con->shards[j].batchindex=NULL;
+      }
+    } else {
+      __atomic_store_n(&con->batchlimit, max_datagram_size, __ATOMIC_RELAXED);
+    }
+  }
+  con->batchdelay=max_delay_ms;
+  pthread_mutex_unlock(&con->batchmutex);
+  return res;
+}
+
+int tlsrpt_flush(struct tlsrpt_connection_t* con) {
+  int res=0;
+  pthread_mutex_lock(&con->batchmutex);
+  /* records moved away from a dead shard may land in a batch flushed before, each further pass needs another shard to die */
+  for(int pass=0, pending=1; pending && pass<=con->shardcount; ++pass) {
+    pending=0;
+    for(int i=0; i<con->shardcount; ++i) {
+      int flushres=flush_batch(con, i);
+      if(res==0) res=flushres;
+    }
+    for(int i=0; i<con->shardcount; ++i) {
+      if(con->shards[i].batchrecords>0) pending=1;
+    }
+  }
+  res=take_batch_error(con, res);
+  pthread_mutex_unlock(&con->batchmutex);
+  return res;
+}
+
+int tlsrpt_flush_if_due(struct tlsrpt_connection_t* con, int* next_ms) {
+  int res=0;
+  int wait=-1;
+  if(__atomic_load_n(&con->batchlimit, __ATOMIC_RELAXED)!=0) {
+    pthread_mutex_lock(&con->batchmutex);
+    if(con->batchdelay>0) {
+      for(int i=0; i<con->shardcount; ++i) {
+	if(con->shards[i].batchrecords>0 && batch_age(&con->shards[i])>=con->batchdelay) {
+	  int flushres=flush_batch(con, i);
+	  if(res==0) res=flushres;
+	}
+      }
+      /* the batches left over, including records moved away from a dead shard, determine the next deadline */
+      for(int i=0; i<con->shardcount; ++i) {
+	if(con->shards[i].batchrecords==0) continue;
+	long remaining=con->batchdelay-batch_age(&con->shards[i]);
+	if(remaining<0) remaining=0;
+	if(wait<0 || remaining<wait) wait=remaining;
+      }
+    }
+    res=take_batch_error(con, res);
+    pthread_mutex_unlock(&con->batchmutex);
+  }
+  if(next_ms!=NULL) *next_ms=wait;
+  return res;
+}
+
+int tlsrpt_get_shard(struct tlsrpt_connection_t* con, const char* domainname) {
+  return select_shard(con, hash_string_field(FNV_OFFSET_BASIS, domainname));
+}
+
+int tlsrpt_set_sndbuf(struct tlsrpt_connection_t* con, int size) {
+  if(setsockopt(con->sock_fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size))!=0) return TLSRPT_ERR_SETSOCKOPT+errno;
+  __atomic_store_n(&con->sndbuf, size, __ATOMIC_RELAXED);
+  return 0;
+}
+
+int tlsrpt_set_adaptive_sndbuf(struct tlsrpt_connection_t* con, int max_size) {
+  if(max_size<0) return TLSRPT_ERR_TLSRPT_INVALIDSNDBUF;
+  __atomic_store_n(&con->sndbufmax, max_size, __ATOMIC_RELAXED);
+  return 0;
+}
+
+int tlsrpt_get_send_queue(struct tlsrpt_connection_t* con, int* queued, int* high_water, int* sndbuf) {
+  int depth=0;
+  if(sample_send_queue(con, &depth)!=0) return TLSRPT_ERR_IOCTL+errno;
+  if(queued!=NULL) *queued=depth;
+  if(high_water!=NULL) *high_water=__atomic_load_n(&con->queuehighwater, __ATOMIC_RELAXED);
+  if(sndbuf!=NULL) {
+    socklen_t len=sizeof(*sndbuf);
+    if(getsockopt(con->sock_fd, SOL_SOCKET, SO_SNDBUF, sndbuf, &len)!=0) return TLSRPT_ERR_GETSOCKOPT+errno;
+  }
+  return 0;
+}
+
+int tlsrpt_set_sink_socket(struct tlsrpt_connection_t* con) {
+  int res=tlsrpt_flush(con);
+  con->sink=sink_socket;
+  return res;
+}
+
+int tlsrpt_set_sink_fd(struct tlsrpt_connection_t* con, int fd) {
+  int res=tlsrpt_flush(con);
+  con->sinkfd=fd;
+  con->sink=sink_fd;
+  return res;
+}
+
+int tlsrpt_set_sink_callback(struct tlsrpt_connection_t* con, int (*callback)(void* ctx, char* datagram, size_t size), void* ctx) {
+  int res=tlsrpt_flush(con);
+  con->sinkcallback=callback;
+  con->sinkctx=ctx;
+  con->sink=sink_callback;
+  return res;
+}
+
+int tlsrpt_set_capture(struct tlsrpt_connection_t* con, const char* filename, size_t size, unsigned int sample_rate) {
+  if(con->capture!=NULL) {
+    munmap(con->capture, con->capturemapsize);
+    con->capture=NULL;
+  }
+  if(filename==NULL) return 0;
+
+  int fd=open(filename, O_RDWR|O_CREAT, 0600);
+  if(fd<0) return TLSRPT_ERR_OPEN_CAPTURE+errno;
+  size_t mapsize=sizeof(tlsrpt_capture_header_t)+CAPTURE_ALIGN(size);
+  /* preallocate the whole ring so writing never has to wait for the file system to allocate blocks */
+  int res=posix_fallocate(fd, 0, mapsize);
+  if(res!=0) {
+    close(fd);
+    return TLSRPT_ERR_FALLOCATE_CAPTURE+res;
+  }
+  tlsrpt_capture_header_t *capture=mmap(NULL, mapsize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  res=errno;
+  close(fd);
+  if(capture==MAP_FAILED) return TLSRPT_ERR_MMAP_CAPTURE+res;
+
+  /* an existing capture of the same size is continued, anything else is started from scratch */
+  if(memcmp(capture->magic, CAPTURE_FILE_MAGIC, sizeof(capture->magic))!=0 || capture->capacity!=CAPTURE_ALIGN(size) || capture->head>capture->capacity) {
+    memcpy(capture->magic, CAPTURE_FILE_MAGIC, sizeof(capture->magic));
+    capture->capacity=CAPTURE_ALIGN(size);
+    capture->head=0;
+    capture->lap=0;
+    capture->lapend=0;
+  }
+  con->capturemapsize=mapsize;
+  con->capturerate=(sample_rate>0)?sample_rate:1;
+  con->capturecounter=0;
+  con->capture=capture;
+  return 0;
+}
+
+/* Returns the first record at or after pos from which the records chain up to exactly end, end if there is none */
+static uint64_t find_record_chain(const char* ring, uint64_t pos, uint64_t end) {
+  for(; pos+sizeof(tlsrpt_capture_record_t)<=end; pos+=CAPTURE_ALIGN(1)) {
+    uint64_t next=pos;
+    while(next+sizeof(tlsrpt_capture_record_t)<=end) {
+      const tlsrpt_capture_record_t *record=(const tlsrpt_capture_record_t*)(ring+next);
+      if(__atomic_load_n(&record->magic, __ATOMIC_ACQUIRE)!=CAPTURE_RECORD_MAGIC) break;
+      uint64_t after=next+sizeof(tlsrpt_capture_record_t)+CAPTURE_ALIGN(record->length);
+      if(after>end) break;
+      next=after;
+    }
+    if(next==end) return pos;
+  }
+  return end;
+}
+
+/* Calls the callback for the records from pos up to end, returns non-zero if replaying must stop */
+static int replay_records(const char* ring, uint64_t pos, uint64_t end, int (*callback)(void* ctx, const char* data, size_t size, long long timestamp_ns), void* ctx) {
+  while(pos+sizeof(tlsrpt_capture_record_t)<=end) {
+    const tlsrpt_capture_record_t *record=(const tlsrpt_capture_record_t*)(ring+pos);
+    if(__atomic_load_n(&record->magic, __ATOMIC_ACQUIRE)!=CAPTURE_RECORD_MAGIC) return 1; /* record is still being written */
+    uint64_t next=pos+sizeof(tlsrpt_capture_record_t)+CAPTURE_ALIGN(record->length);
+    if(next>end) return 1;
+    if(callback(ctx, (const char*)(record+1), record->length, record->timestamp)!=0) return 1;
+    pos=next;
+  }
+  return 0;
+}
+
+int tlsrpt_replay_capture(const char* filename, int (*callback)(void* ctx, const char* data, size_t size, long long timestamp_ns), void* ctx) {
+  int fd=open(filename, O_RDONLY);
+  if(fd<0) return TLSRPT_ERR_OPEN_CAPTURE+errno;
+  off_t filesize=lseek(fd, 0, SEEK_END);
+  if(filesize<(off_t)sizeof(tlsrpt_capture_header_t)) {
+    close(fd);
+    return TLSRPT_ERR_TLSRPT_CAPTUREINVALID;
+  }
+  tlsrpt_capture_header_t *capture=mmap(NULL, filesize, PROT_READ, MAP_SHARED, fd, 0);
+  int res=errno;
+  close(fd);
+  if(capture==MAP_FAILED) return TLSRPT_ERR_MMAP_CAPTURE+res;
+
+  res=0;
+  if(memcmp(capture->magic, CAPTURE_FILE_MAGIC, sizeof(capture->magic))!=0 || sizeof(tlsrpt_capture_header_t)+capture->capacity>(uint64_t)filesize) {
+    res=TLSRPT_ERR_TLSRPT_CAPTUREINVALID;
+  } else {
+    /* the surviving records of the previous lap between head and its end are older than the current lap from the start of the ring up to head */
+    const char *ring=(const char*)(capture+1);
+    uint64_t head=__atomic_load_n(&capture->head, __ATOMIC_ACQUIRE);
+    uint64_t lapend=__atomic_load_n(&capture->lapend, __ATOMIC_ACQUIRE);
+    if(head>capture->capacity) head=capture->capacity;
+    if(lapend>capture->capacity) lapend=capture->capacity;
+    int stop=0;
+    if(capture->lap>0 && lapend>head) {
+      /* the record at head may have been cut by the current lap, replaying resumes at the first record that chains up to the end of the lap */
+      stop=replay_records(ring, find_record_chain(ring, head, lapend), lapend, callback, ctx);
+    }
+    if(!stop) replay_records(ring, 0, head, callback, ctx);
+  }
+  munmap(capture, filesize);
+  return res;
+}
+
 /* BEGIN DEBUG tools */
 static int dbgnumber=999;
 
@@ -523,33 +1870,40 @@ Calls to errorcode will record the errorcode in the tlsrpt_dr_t structure, but t
   }
 
   /* Check if finish_policy was called properly and clean up left-overs otherwise */
-  if(dr->memstreamps != NULL) {
+  if(dr->in_policy || dr->dropping_policy) {
     errorcode(dr, TLSRPT_ERR_TLSRPT_UNFINISHEDPOLICY);
     tlsrpt_finish_policy(dr,TLSRPT_FINAL_FAILURE);
   }
 
   if(dr->policy_count>0) {
-    res=fprintf(dr->memstream, "]");
+    res=TLSRPT_SERIALIZE_LITERAL(dr->memstream, TLSRPT_LIST_END);
     if(res<0) errorcode(dr,TLSRPT_ERR_FPRINTF_FINISHDR+errno);
   } else {
     errorcode(dr, TLSRPT_ERR_TLSRPT_NOPOLICIES);
   }
 
-  res=fprintf(dr->memstream, "}");
+  if(dr->dropped_policies>0) {
+    res=tlsrpt_serialize_dropped_policies(dr->memstream, dr->dropped_policies);
+    if(res==0) res=tlsrpt_serialize_dropped_failures(dr->memstream, dr->dropped_failures);
+    if(res<0) errorcode(dr,TLSRPT_ERR_FPRINTF_FINISHDR+errno);
+  }
+  if(dr->truncated) {
+    res=TLSRPT_SERIALIZE_LITERAL(dr->memstream, TLSRPT_ATTR_TRUNCATED);
+    if(res<0) errorcode(dr,TLSRPT_ERR_FPRINTF_FINISHDR+errno);
+  }
+
+  res=TLSRPT_SERIALIZE_LITERAL(dr->memstream, TLSRPT_OBJECT_END);
   if(res<0) errorcode(dr,TLSRPT_ERR_FPRINTF_FINISHDR+errno);
 
   res=fclose(dr->memstream);
   if(res!=0) errorcode(dr,TLSRPT_ERR_FCLOSE_FINISHDR+errno);
 
   if(dr->status == 0) { // everything looks fine, we can send the datagram
-    res = sendto(dr->con->sock_fd, dr->memstreambuffer, dr->memstreamsize,
-		 tlsrpt_sendto_flags, (const struct sockaddr *) &dr->con->addr,
-		 sizeof(struct sockaddr_un));
-    if(res<0) errorcode(dr,TLSRPT_ERR_SENDTO+errno);
+    DEBUG debug_datagram_hook(dr->memstreambuffer);
+    res=queue_datagram(dr->con, dr->domainhash, &dr->memstreambuffer, dr->memstreamsize);
+    if(res!=0) errorcode(dr,res);
   }
 
-  DEBUG debug_datagram_hook(dr->memstreambuffer);
-
   free(dr->memstreambuffer);
   int finalresult=dr->status;
 
@@ -0,0 +1,729 @@
+/*
+    Copyright (C) 2024-2025 sys4 AG
+    Author Boris Lohner bl@sys4.de
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this program.
+    If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+  tlsrpt-loadgen drives the full tlsrpt_* call sequence at a controlled rate to capacity-plan a TLSRPT collectd.
+
+  The corpus of delivery requests is either read from a capture file written by tlsrpt_set_capture
+  or generated from a mix file describing the share of delivery request shapes, one per line:
+
+    # weight policy-type failures distinct-failures
+    80 none 0 0
+    15 sts 0 0
+    5 tlsa 20 2
+
+  policy-type is one of none, sts or tlsa.
+*/
+
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include "tlsrpt.h"
+
+#define SOCKET_NAME "/tmp/tlsrpt-collectd.socket"
+#define MAX_ERRORS 1000
+#define MAX_SOCKETS 16
+
+/* A delivery request of the corpus as a sequence of library calls */
+struct failure {
+  int code;
+  char *sending_mta_ip, *receiving_mx_hostname, *receiving_mx_helo, *receiving_ip, *additional_information, *failure_reason_code;
+  int count;
+};
+
+struct policy {
+  int policy_type;
+  char *policy_domain;
+  int final_result;
+  int policy_string_count;
+  char **policy_strings;
+  int mx_host_count;
+  char **mx_hosts;
+  int failure_count;
+  struct failure *failures;
+};
+
+struct delivery {
+  char *domain;
+  char *policyrecord;
+  int policy_count;
+  struct policy *policies;
+};
+
+static struct delivery *corpus=NULL;
+static int corpus_size=0;
+static int corpus_alloc=0;
+
+/* Options */
+static const char *socketnames[MAX_SOCKETS]={SOCKET_NAME};
+static int socketcount=0;
+static int threads=1;
+static double start_rate=0; /* deliveries per second, 0 for as fast as possible */
+static double end_rate=-1; /* ramp towards this rate, -1 for a fixed rate */
+static double duration=10;
+static int run_receiver=0;
+static double kill_receiver=-1; /* seconds after which the first stand-in receiver stops, -1 to keep it running */
+static int shared_connection=0;
+static size_t batch_size=0;
+static int batch_delay=0;
+static int discard=0; /* discard the datagrams within the process to measure the library alone */
+static int deduplicate=0;
+
+static struct timespec start_time;
+static volatile int stop=0;
+
+static struct tlsrpt_connection_t *shared_con=NULL;
+
+struct thread_result {
+  long attempted;
+  long sent;
+  long errors[MAX_ERRORS];
+  double cpu; /* seconds of thread CPU time spent in library calls */
+};
+
+static void* xmalloc(size_t size) {
+  void *p=calloc(1, size);
+  if(p==NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  return p;
+}
+
+static char* xstrdup(const char* s) {
+  if(s==NULL) return NULL;
+  char *p=strdup(s);
+  if(p==NULL) {
+    perror("strdup");
+    exit(1);
+  }
+  return p;
+}
+
+static struct delivery* new_delivery() {
+  if(corpus_size==corpus_alloc) {
+    corpus_alloc=corpus_alloc>0?corpus_alloc*2:64;
+    corpus=realloc(corpus, corpus_alloc*sizeof(struct delivery));
+    if(corpus==NULL) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  memset(&corpus[corpus_size], 0, sizeof(struct delivery));
+  return &corpus[corpus_size++];
+}
+
+static double elapsed() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec-start_time.tv_sec)+(now.tv_nsec-start_time.tv_nsec)/1e9;
+}
+
+static double thread_cpu() {
+  struct timespec now;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+  return now.tv_sec+now.tv_nsec/1e9;
+}
+
+
+/* BEGIN minimal JSON parser for the datagrams written by libtlsrpt */
+enum json_type { JSON_NULL, JSON_NUMBER, JSON_STRING, JSON_ARRAY, JSON_OBJECT };
+
+struct json {
+  enum json_type type;
+  long number;
+  char *string;
+  int count; /* number of array elements or object members */
+  char **keys;
+  struct json **values;
+};
+
+static struct json* json_parse_value(const char **p, const char *end);
+
+static void json_skip_space(const char **p, const char *end) {
+  while(*p<end && isspace((unsigned char)**p)) ++*p;
+}
+
+static void json_free(struct json *j) {
+  if(j==NULL) return;
+  for(int i=0; i<j->count; ++i) {
+    if(j->keys!=NULL) free(j->keys[i]);
+    json_free(j->values[i]);
+  }
+  free(j->keys);
+  free(j->values);
+  free(j->string);
+  free(j);
+}
+
+static char* json_parse_string(const char **p, const char *end) {
+  if(*p>=end || **p!='"') return NULL;
+  ++*p;
+  char *s=xmalloc(end-*p+1);
+  char *o=s;
+  while(*p<end && **p!='"') {
+    if(**p=='\\' && *p+1<end) {
+      ++*p;
+      switch(**p) {
+      case 'b': *o++='\b'; break;
+      case 'f': *o++='\f'; break;
+      case 'n': *o++='\n'; break;
+      case 'r': *o++='\r'; break;
+      case 't': *o++='\t'; break;
+      case 'u':
+	/* libtlsrpt only escapes control characters with \u */
+	if(*p+4>=end) goto fail;
+	*o++=(char)strtol((char[]){(*p)[1],(*p)[2],(*p)[3],(*p)[4],0}, NULL, 16);
+	*p+=4;
+	break;
+      default: *o++=**p;
+      }
+      ++*p;
+    } else {
+      *o++=*(*p)++;
+    }
+  }
+  if(*p>=end) goto fail;
+  ++*p;
+  *o=0;
+  return s;
+ fail:
+  free(s);
+  return NULL;
+}
+
+static int json_append(struct json *j, char *key, struct json *value) {
+  j->values=realloc(j->values, (j->count+1)*sizeof(struct json*));
+  if(j->type==JSON_OBJECT) j->keys=realloc(j->keys, (j->count+1)*sizeof(char*));
+  if(j->values==NULL || (j->type==JSON_OBJECT && j->keys==NULL)) {
+    perror("realloc");
+    exit(1);
+  }
+  if(j->type==JSON_OBJECT) j->keys[j->count]=key;
+  j->values[j->count++]=value;
+  return 0;
+}
+
+static struct json* json_parse_container(const char **p, const char *end, enum json_type type) {
+  struct json *j=xmalloc(sizeof(struct json));
+  j->type=type;
+  char close=(type==JSON_OBJECT)?'}':']';
+  ++*p;
+  json_skip_space(p, end);
+  if(*p<end && **p==close) {
+    ++*p;
+    return j;
+  }
+  while(*p<end) {
+    char *key=NULL;
+    if(type==JSON_OBJECT) {
+      json_skip_space(p, end);
+      key=json_parse_string(p, end);
+      if(key==NULL) break;
+      json_skip_space(p, end);
+      if(*p>=end || **p!=':') {
+	free(key);
+	break;
+      }
+      ++*p;
+    }
+    struct json *value=json_parse_value(p, end);
+    if(value==NULL) {
+      free(key);
+      break;
+    }
+    json_append(j, key, value);
+    json_skip_space(p, end);
+    if(*p<end && **p==',') {
+      ++*p;
+      continue;
+    }
+    if(*p<end && **p==close) {
+      ++*p;
+      return j;
+    }
+    break;
+  }
+  json_free(j);
+  return NULL;
+}
+
+static struct json* json_parse_value(const char **p, const char *end) {
+  json_skip_space(p, end);
+  if(*p>=end) return NULL;
+  if(**p=='{') return json_parse_container(p, end, JSON_OBJECT);
+  if(**p=='[') return json_parse_container(p, end, JSON_ARRAY);
+  if(**p=='"') {
+    char *s=json_parse_string(p, end);
+    if(s==NULL) return NULL;
+    struct json *j=xmalloc(sizeof(struct json));
+    j->type=JSON_STRING;
+    j->string=s;
+    return j;
+  }
+  if(**p=='-' || isdigit((unsigned char)**p)) {
+    struct json *j=xmalloc(sizeof(struct json));
+    j->type=JSON_NUMBER;
+    j->number=**p=='-'?-1:1;
+    if(**p=='-') ++*p;
+    long n=0;
+    while(*p<end && isdigit((unsigned char)**p)) n=n*10+(*(*p)++-'0');
+    j->number*=n;
+    return j;
+  }
+  return NULL;
+}
+
+static struct json* json_get(struct json *j, const char *key) {
+  if(j==NULL || j->type!=JSON_OBJECT) return NULL;
+  for(int i=0; i<j->count; ++i) {
+    if(strcmp(j->keys[i], key)==0) return j->values[i];
+  }
+  return NULL;
+}
+
+static char* json_get_string(struct json *j, const char *key) {
+  struct json *v=json_get(j, key);
+  return (v!=NULL && v->type==JSON_STRING)?xstrdup(v->string):NULL;
+}
+
+static long json_get_number(struct json *j, const char *key, long dflt) {
+  struct json *v=json_get(j, key);
+  return (v!=NULL && v->type==JSON_NUMBER)?v->number:dflt;
+}
+
+static char** json_get_strings(struct json *j, const char *key, int *count) {
+  struct json *v=json_get(j, key);
+  *count=0;
+  if(v==NULL || v->type!=JSON_ARRAY) return NULL;
+  char **strings=xmalloc(v->count*sizeof(char*));
+  for(int i=0; i<v->count; ++i) {
+    if(v->values[i]->type==JSON_STRING) strings[(*count)++]=xstrdup(v->values[i]->string);
+  }
+  return strings;
+}
+/* END minimal JSON parser */
+
+
+/* Converts one delivery request datagram of protocol version 1 into its call sequence */
+static void add_delivery_from_json(struct json *j) {
+  struct json *policies=json_get(j, "policies");
+  if(policies==NULL || policies->type!=JSON_ARRAY) return;
+  struct delivery *d=new_delivery();
+  d->domain=json_get_string(j, "d");
+  d->policyrecord=json_get_string(j, "pr");
+  d->policy_count=policies->count;
+  d->policies=xmalloc(policies->count*sizeof(struct policy));
+  for(int i=0; i<policies->count; ++i) {
+    struct json *pj=policies->values[i];
+    struct policy *p=&d->policies[i];
+    p->policy_type=json_get_number(pj, "policy-type", TLSRPT_NO_POLICY_FOUND);
+    p->policy_domain=json_get_string(pj, "policy-domain");
+    p->final_result=json_get_number(pj, "f", TLSRPT_FINAL_SUCCESS);
+    p->policy_strings=json_get_strings(pj, "policy-string", &p->policy_string_count);
+    p->mx_hosts=json_get_strings(pj, "mx-host", &p->mx_host_count);
+    struct json *fds=json_get(pj, "failure-details");
+    if(fds==NULL || fds->type!=JSON_ARRAY) continue;
+    p->failure_count=fds->count;
+    p->failures=xmalloc(fds->count*sizeof(struct failure));
+    for(int k=0; k<fds->count; ++k) {
+      struct json *fj=fds->values[k];
+      struct failure *f=&p->failures[k];
+      f->code=json_get_number(fj, "c", 0);
+      f->sending_mta_ip=json_get_string(fj, "s");
+      f->receiving_mx_hostname=json_get_string(fj, "n");
+      f->receiving_mx_helo=json_get_string(fj, "h");
+      f->receiving_ip=json_get_string(fj, "r");
+      f->additional_information=json_get_string(fj, "a");
+      f->failure_reason_code=json_get_string(fj, "f");
+      f->count=json_get_number(fj, "k", 1);
+    }
+  }
+}
+
+static int add_captured_datagram(void* ctx, const char* data, size_t size, long long timestamp_ns) {
+  const char *p=data;
+  struct json *j=json_parse_value(&p, data+size);
+  if(j==NULL) {
+    fprintf(stderr, "Skipping unparseable datagram captured at %lld\n", timestamp_ns);
+    return 0;
+  }
+  struct json *batch=json_get(j, "b");
+  if(batch!=NULL && batch->type==JSON_ARRAY) {
+    for(int i=0; i<batch->count; ++i) add_delivery_from_json(batch->values[i]);
+  } else {
+    add_delivery_from_json(j);
+  }
+  json_free(j);
+  return 0;
+}
+
+/* Generates the corpus from a mix file, each line adds weight deliveries of the described shape */
+static int load_mix(const char *filename) {
+  FILE *f=fopen(filename, "r");
+  if(f==NULL) {
+    perror(filename);
+    return -1;
+  }
+  char line[1024];
+  int lineno=0;
+  while(fgets(line, sizeof(line), f)!=NULL) {
+    ++lineno;
+    int weight, failures, distinct;
+    char type[32];
+    if(line[0]=='#' || line[strspn(line, " \t\r\n")]==0) continue;
+    if(sscanf(line, "%d %31s %d %d", &weight, type, &failures, &distinct)!=4 || weight<0 || failures<0) {
+      fprintf(stderr, "%s:%d: expected \"weight policy-type failures distinct-failures\"\n", filename, lineno);
+      fclose(f);
+      return -1;
+    }
+    if(distinct<1) distinct=1;
+    for(int w=0; w<weight; ++w) {
+      char name[64];
+      struct delivery *d=new_delivery();
+      snprintf(name, sizeof(name), "domain%d.example", corpus_size);
+      d->domain=xstrdup(name);
+      d->policyrecord=xstrdup("v=TLSRPTv1;rua=mailto:reports@example.com");
+      d->policy_count=1;
+      d->policies=xmalloc(sizeof(struct policy));
+      struct policy *p=d->policies;
+      p->final_result=(failures>0)?TLSRPT_FINAL_FAILURE:TLSRPT_FINAL_SUCCESS;
+      if(strcmp(type, "sts")==0) {
+	p->policy_type=TLSRPT_POLICY_STS;
+	p->policy_domain=xstrdup(name);
+	p->policy_string_count=4;
+	p->policy_strings=xmalloc(4*sizeof(char*));
+	p->policy_strings[0]=xstrdup("version: STSv1");
+	p->policy_strings[1]=xstrdup("mode: enforce");
+	p->policy_strings[2]=xstrdup("mx: *.mail.example");
+	p->policy_strings[3]=xstrdup("max_age: 86400");
+	p->mx_host_count=1;
+	p->mx_hosts=xmalloc(sizeof(char*));
+	p->mx_hosts[0]=xstrdup("*.mail.example");
+      } else if(strcmp(type, "tlsa")==0) {
+	p->policy_type=TLSRPT_POLICY_TLSA;
+	p->policy_domain=xstrdup(name);
+	p->policy_string_count=1;
+	p->policy_strings=xmalloc(sizeof(char*));
+	p->policy_strings[0]=xstrdup("3 0 1 1F850A337E6DB9C609C522D136A475638CC43E1ED424F8EEC8513D747D1D085D");
+      } else {
+	p->policy_type=TLSRPT_NO_POLICY_FOUND;
+      }
+      p->failure_count=(failures<distinct)?failures:distinct;
+      p->failures=xmalloc(p->failure_count*sizeof(struct failure));
+      for(int k=0; k<p->failure_count; ++k) {
+	struct failure *fd=&p->failures[k];
+	char ip[32];
+	snprintf(ip, sizeof(ip), "192.0.2.%d", k%250+1);
+	fd->code=(p->policy_type==TLSRPT_POLICY_TLSA)?TLSRPT_TLSA_INVALID:TLSRPT_CERTIFICATE_NOT_TRUSTED;
+	fd->sending_mta_ip=xstrdup("198.51.100.1");
+	fd->receiving_mx_hostname=xstrdup("mx.mail.example");
+	fd->receiving_mx_helo=xstrdup("mx.mail.example");
+	fd->receiving_ip=xstrdup(ip);
+	fd->additional_information=xstrdup("synthetic failure generated by tlsrpt-loadgen");
+	fd->failure_reason_code=NULL;
+	/* spread the failures over the distinct failure details */
+	fd->count=failures/p->failure_count+((k<failures%p->failure_count)?1:0);
+      }
+    }
+  }
+  fclose(f);
+  return 0;
+}
+
+
+/* Runs the call sequence of one delivery request and returns the result of tlsrpt_finish_delivery_request */
+static int run_delivery(struct tlsrpt_connection_t *con, const struct delivery *d) {
+  struct tlsrpt_dr_t *dr=NULL;
+  int res=tlsrpt_init_delivery_request(&dr, con, d->domain, d->policyrecord);
+  if(res!=0) return res;
+  for(int i=0; i<d->policy_count; ++i) {
+    const struct policy *p=&d->policies[i];
+    tlsrpt_init_policy(dr, p->policy_type, p->policy_domain);
+    for(int k=0; k<p->policy_string_count; ++k) tlsrpt_add_policy_string(dr, p->policy_strings[k]);
+    for(int k=0; k<p->mx_host_count; ++k) tlsrpt_add_mx_host_pattern(dr, p->mx_hosts[k]);
+    for(int k=0; k<p->failure_count; ++k) {
+      const struct failure *f=&p->failures[k];
+      for(int n=0; n<f->count; ++n) {
+	tlsrpt_add_delivery_request_failure(dr, f->code, f->sending_mta_ip, f->receiving_mx_hostname, f->receiving_mx_helo,
+					    f->receiving_ip, f->additional_information, f->failure_reason_code);
+      }
+    }
+    tlsrpt_finish_policy(dr, p->final_result);
+  }
+  return tlsrpt_finish_delivery_request(&dr);
+}
+
+/* Number of deliveries that should have been started by all threads after t seconds */
+static double target_deliveries(double t) {
+  if(end_rate<0) return start_rate*t;
+  return start_rate*t+(end_rate-start_rate)*t*t/(2*duration);
+}
+
+static int discard_datagram(void* ctx, char* datagram, size_t size) {
+  free(datagram);
+  return 0;
+}
+
+static int setup_connection(struct tlsrpt_connection_t* con) {
+  int res=0;
+  if(batch_size>0) res=tlsrpt_set_batching(con, batch_size, batch_delay);
+  if(res==0 && discard) res=tlsrpt_set_sink_callback(con, discard_datagram, NULL);
+  if(res==0 && deduplicate) res=tlsrpt_set_deduplication(con, 1);
+  return res;
+}
+
+/* Deliveries started by all threads so far, all threads draw from the same schedule */
+static long scheduled=0;
+
+static void* sender_thread(void *arg) {
+  struct thread_result *result=arg;
+  struct tlsrpt_connection_t *con=shared_con;
+  int res=0;
+  if(con==NULL) {
+    res=tlsrpt_open_shards(&con, socketnames, socketcount);
+    if(res==0) res=setup_connection(con);
+    if(res!=0) {
+      fprintf(stderr, "tlsrpt_open: %s\n", tlsrpt_strerror(res));
+      return NULL;
+    }
+  }
+  for(;;) {
+    double t=elapsed();
+    if(t>=duration) break;
+    long next=__atomic_load_n(&scheduled, __ATOMIC_RELAXED);
+    if((start_rate>0 || end_rate>0) && next>=(long)target_deliveries(t)) {
+      /* like an idle MTA, send out the batches that reached their deadline */
+      tlsrpt_flush_if_due(con, NULL);
+      struct timespec pause={0, 100000};
+      nanosleep(&pause, NULL);
+      continue;
+    }
+    if(!__atomic_compare_exchange_n(&scheduled, &next, next+1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) continue;
+
+    double cpu=thread_cpu();
+    res=run_delivery(con, &corpus[next%corpus_size]);
+    result->cpu+=thread_cpu()-cpu;
+    ++result->attempted;
+    if(res==0) {
+      ++result->sent;
+    } else {
+      ++result->errors[tlsrpt_errno_from_error_code(res)%MAX_ERRORS];
+    }
+  }
+  if(con!=shared_con) {
+    res=tlsrpt_close(&con);
+    if(res!=0) ++result->errors[tlsrpt_errno_from_error_code(res)%MAX_ERRORS];
+  }
+  return NULL;
+}
+
+
+/* Stand-in receivers counting the datagrams arriving on each socket */
+struct receiver {
+  const char *socketname;
+  int fd;
+  double lifetime; /* seconds until the receiver stops, -1 to run until the end */
+  long datagrams;
+  long bytes;
+  pthread_t thread;
+};
+
+static struct receiver receivers[MAX_SOCKETS];
+
+static int open_receiver(struct receiver *r) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family=AF_UNIX;
+  strncpy(addr.sun_path, r->socketname, sizeof(addr.sun_path)-1);
+  unlink(r->socketname);
+  r->fd=socket(AF_UNIX, SOCK_DGRAM, 0);
+  if(r->fd<0 || bind(r->fd, (struct sockaddr*)&addr, sizeof(addr))!=0) {
+    perror(r->socketname);
+    return -1;
+  }
+  struct timeval timeout={0, 100000};
+  setsockopt(r->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  return 0;
+}
+
+static void* receiver_thread(void *arg) {
+  struct receiver *r=arg;
+  static __thread char buffer[65536];
+  while(r->lifetime<0 || elapsed()<r->lifetime) {
+    ssize_t n=recv(r->fd, buffer, sizeof(buffer), 0);
+    if(n>=0) {
+      ++r->datagrams;
+      r->bytes+=n;
+    } else if(stop) {
+      break;
+    }
+  }
+  /* a stopped receiver vanishes like a crashed TLSRPT collectd */
+  close(r->fd);
+  unlink(r->socketname);
+  return NULL;
+}
+
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s (-c capturefile | -m mixfile) [options]\n\
+  -s socket      socket of the TLSRPT collectd (default %s), repeat to shard by domain\n\
+  -t threads     number of sending threads (default 1)\n\
+  -r rate        deliveries per second, 0 for as fast as possible (default 0)\n\
+  -R rate        ramp linearly from the -r rate to this rate over the duration\n\
+  -d seconds     duration of the run (default 10)\n\
+  -b bytes       batch delivery requests into datagrams of up to this size\n\
+  -D ms          maximum batch delay\n\
+  -o             share one connection between all threads\n\
+  -B             use blocking sendto\n\
+  -N             discard the datagrams without sending them, to measure the library alone\n\
+  -k             send identical failure details once with their count\n\
+  -n             run a stand-in receiver on each socket\n\
+  -K seconds     stop the stand-in receiver of the first socket after this time\n", name, SOCKET_NAME);
+}
+
+int main(int argc, char *argv[])
+{
+  const char *capturefile=NULL;
+  const char *mixfile=NULL;
+  int opt;
+  while((opt=getopt(argc, argv, "c:m:s:t:r:R:d:b:D:oBNknK:h"))!=-1) {
+    switch(opt) {
+    case 'c': capturefile=optarg; break;
+    case 'm': mixfile=optarg; break;
+    case 's':
+      if(socketcount==MAX_SOCKETS) {
+	fprintf(stderr, "At most %d sockets are supported\n", MAX_SOCKETS);
+	return 2;
+      }
+      socketnames[socketcount++]=optarg;
+      break;
+    case 't': threads=atoi(optarg); break;
+    case 'r': start_rate=atof(optarg); break;
+    case 'R': end_rate=atof(optarg); break;
+    case 'd': duration=atof(optarg); break;
+    case 'b': batch_size=atol(optarg); break;
+    case 'D': batch_delay=atoi(optarg); break;
+    case 'o': shared_connection=1; break;
+    case 'B': tlsrpt_set_blocking(); break;
+    case 'N': discard=1; break;
+    case 'k': deduplicate=1; break;
+    case 'n': run_receiver=1; break;
+    case 'K': kill_receiver=atof(optarg); break;
+    default:
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if((capturefile==NULL)==(mixfile==NULL) || threads<1 || duration<=0) {
+    usage(argv[0]);
+    return 2;
+  }
+  if(socketcount==0) socketcount=1;
+
+  if(capturefile!=NULL) {
+    int res=tlsrpt_replay_capture(capturefile, add_captured_datagram, NULL);
+    if(res!=0) {
+      fprintf(stderr, "%s: %s\n", capturefile, tlsrpt_strerror(res));
+      return 1;
+    }
+  } else if(load_mix(mixfile)!=0) {
+    return 1;
+  }
+  if(corpus_size==0) {
+    fprintf(stderr, "The corpus is empty\n");
+    return 1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
+  if(run_receiver) {
+    for(int i=0; i<socketcount; ++i) {
+      receivers[i].socketname=socketnames[i];
+      receivers[i].lifetime=(i==0)?kill_receiver:-1;
+      if(open_receiver(&receivers[i])!=0) return 1;
+      pthread_create(&receivers[i].thread, NULL, receiver_thread, &receivers[i]);
+    }
+  }
+  if(shared_connection) {
+    int res=tlsrpt_open_shards(&shared_con, socketnames, socketcount);
+    if(res==0) res=setup_connection(shared_con);
+    if(res!=0) {
+      fprintf(stderr, "tlsrpt_open: %s\n", tlsrpt_strerror(res));
+      return 1;
+    }
+  }
+
+  struct thread_result *results=xmalloc(threads*sizeof(struct thread_result));
+  pthread_t *senders=xmalloc(threads*sizeof(pthread_t));
+  for(int i=0; i<threads; ++i) pthread_create(&senders[i], NULL, sender_thread, &results[i]);
+  for(int i=0; i<threads; ++i) pthread_join(senders[i], NULL);
+  if(shared_con!=NULL) tlsrpt_close(&shared_con);
+  double runtime=elapsed();
+
+  if(run_receiver) {
+    /* give the receiver the chance to drain the socket */
+    struct timespec pause={0, 200000000};
+    nanosleep(&pause, NULL);
+    stop=1;
+    for(int i=0; i<socketcount; ++i) pthread_join(receivers[i].thread, NULL);
+  }
+
+  struct thread_result total;
+  memset(&total, 0, sizeof(total));
+  for(int i=0; i<threads; ++i) {
+    total.attempted+=results[i].attempted;
+    total.sent+=results[i].sent;
+    total.cpu+=results[i].cpu;
+    for(int e=0; e<MAX_ERRORS; ++e) total.errors[e]+=results[i].errors[e];
+  }
+
+  printf("corpus:              %d delivery requests\n", corpus_size);
+  printf("runtime:             %.3f s with %d threads\n", runtime, threads);
+  printf("attempted:           %ld deliveries, %.1f deliveries/s\n", total.attempted, total.attempted/runtime);
+  printf("sent:                %ld deliveries, %.1f deliveries/s\n", total.sent, total.sent/runtime);
+  printf("dropped:             %ld deliveries\n", total.attempted-total.sent);
+  for(int e=0; e<MAX_ERRORS; ++e) {
+    if(total.errors[e]==0) continue;
+    if(e>=700) printf("  internal %d:        %ld (%s)\n", e, total.errors[e], tlsrpt_strerror(TLSRPT_ERR_TLSRPT+e));
+    else printf("  errno %3d:          %ld (%s)\n", e, total.errors[e], strerror(e));
+  }
+  if(total.attempted>0) printf("client CPU:          %.2f us per delivery\n", total.cpu*1e6/total.attempted);
+  if(run_receiver) {
+    long datagrams=0;
+    long bytes=0;
+    for(int i=0; i<socketcount; ++i) {
+      datagrams+=receivers[i].datagrams;
+      bytes+=receivers[i].bytes;
+    }
+    printf("received:            %ld datagrams, %.1f datagrams/s, %ld bytes\n", datagrams, datagrams/runtime, bytes);
+    if(socketcount>1) {
+      for(int i=0; i<socketcount; ++i) printf("  %-18s %ld datagrams, %ld bytes\n", receivers[i].socketname, receivers[i].datagrams, receivers[i].bytes);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,276 @@
+/*
+    Copyright (C) 2024-2025 sys4 AG
+    Author Boris Lohner bl@sys4.de
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this program.
+    If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+Checks that the delivery requests of a domain reach exactly one of several sockets opened with tlsrpt_open_shards,
+before, while and after one of the receivers dies, without and with batching,
+that delivery requests exported from a connection with a single socket reach the shard of their domain
+and that tlsrpt_flush_if_due sends the batches of all shards at their deadline.
+Run by "make check".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "tlsrpt.h"
+
+#define SHARDS 3
+#define DOMAINS 60
+#define REPEAT 3
+
+static char dir[]="/tmp/tlsrpt-shardcheck-XXXXXX";
+static char socketnames[SHARDS][128];
+static int receivers[SHARDS];
+
+static int received[DOMAINS][SHARDS]; /* delivery requests per domain and receiver in the current phase */
+static int failures=0;
+
+static void check(int condition, const char* phase, int domain, const char* message) {
+  if(condition) return;
+  fprintf(stderr, "FAIL %s: d%d.example %s\n", phase, domain, message);
+  ++failures;
+}
+
+static int open_receiver(int shard) {
+  receivers[shard]=socket(AF_UNIX, SOCK_DGRAM, 0);
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family=AF_UNIX;
+  strcpy(addr.sun_path, socketnames[shard]);
+  unlink(socketnames[shard]);
+  if(receivers[shard]<0 || bind(receivers[shard], (struct sockaddr*)&addr, sizeof(addr))!=0) {
+    perror("bind");
+    return -1;
+  }
+  return 0;
+}
+
+/* Closes a receiver but keeps its socket file, so sending to it fails with ECONNREFUSED */
+static void kill_receiver(int shard) {
+  close(receivers[shard]);
+  receivers[shard]=-1;
+}
+
+/* Counts the delivery requests of all datagrams waiting at the receivers, batches contain several of them */
+static void collect() {
+  static char buffer[70000];
+  for(int shard=0; shard<SHARDS; ++shard) {
+    if(receivers[shard]<0) continue;
+    ssize_t size;
+    while((size=recv(receivers[shard], buffer, sizeof(buffer)-1, MSG_DONTWAIT))>0) {
+      buffer[size]=0;
+      for(const char* p=strstr(buffer, "\"d\": \"d"); p!=NULL; p=strstr(p+1, "\"d\": \"d")) {
+	int domain=atoi(p+7);
+	if(domain>=0 && domain<DOMAINS) ++received[domain][shard];
+      }
+    }
+  }
+}
+
+static void send_delivery_request(struct tlsrpt_connection_t* con, int domain) {
+  char domainname[32];
+  snprintf(domainname, sizeof(domainname), "d%d.example", domain);
+  struct tlsrpt_dr_t *dr=NULL;
+  tlsrpt_init_delivery_request(&dr, con, domainname, "v=TLSRPTv1;rua=mailto:reports@example.com");
+  tlsrpt_init_policy(dr, TLSRPT_NO_POLICY_FOUND, NULL);
+  tlsrpt_finish_policy(dr, TLSRPT_FINAL_SUCCESS);
+  int res=tlsrpt_finish_delivery_request(&dr);
+  if(res!=0) fprintf(stderr, "sending d%d.example: %s\n", domain, tlsrpt_strerror(res));
+}
+
+static int get_shard(struct tlsrpt_connection_t* con, int domain) {
+  char domainname[32];
+  snprintf(domainname, sizeof(domainname), "d%d.example", domain);
+  return tlsrpt_get_shard(con, domainname);
+}
+
+/* Checks that each domain arrived count times at exactly the receiver in expected */
+static void check_phase(const char* phase, const int* expected, int count) {
+  for(int domain=0; domain<DOMAINS; ++domain) {
+    for(int shard=0; shard<SHARDS; ++shard) {
+      if(shard==expected[domain]) check(received[domain][shard]==count, phase, domain, "was lost or duplicated at its receiver");
+      else check(received[domain][shard]==0, phase, domain, "reached a second receiver");
+    }
+  }
+  memset(received, 0, sizeof(received));
+  fprintf(stderr, "%s checked\n", phase);
+}
+
+static struct tlsrpt_connection_t* open_shards() {
+  struct tlsrpt_connection_t *con=NULL;
+  const char *names[SHARDS];
+  for(int shard=0; shard<SHARDS; ++shard) names[shard]=socketnames[shard];
+  if(tlsrpt_open_shards(&con, names, SHARDS)!=0) exit(1);
+  return con;
+}
+
+/* Sends all domains unbatched, kills receiver 0 and checks where the domains go */
+static void check_unbatched() {
+  struct tlsrpt_connection_t *con=open_shards();
+  int home[DOMAINS];
+  int moved[DOMAINS];
+
+  for(int domain=0; domain<DOMAINS; ++domain) home[domain]=get_shard(con, domain);
+  for(int i=0; i<REPEAT; ++i) {
+    for(int domain=0; domain<DOMAINS; ++domain) {
+      send_delivery_request(con, domain);
+      collect();
+    }
+  }
+  check_phase("before", home, REPEAT);
+  tlsrpt_close(&con);
+
+  /* each domain is sent first on a new connection, so each domain of the dead receiver takes the failover path itself */
+  kill_receiver(0);
+  for(int domain=0; domain<DOMAINS; ++domain) {
+    con=open_shards();
+    send_delivery_request(con, domain);
+    collect();
+    moved[domain]=get_shard(con, domain);
+    check(home[domain]==0 || moved[domain]==home[domain], "during", domain, "moved although its receiver is alive");
+    check(moved[domain]!=0, "during", domain, "is still assigned to the dead receiver");
+    tlsrpt_close(&con);
+  }
+  check_phase("during", moved, 1);
+
+  con=open_shards();
+  for(int i=0; i<REPEAT; ++i) {
+    for(int domain=0; domain<DOMAINS; ++domain) {
+      send_delivery_request(con, domain);
+      collect();
+      check(get_shard(con, domain)==moved[domain], "after", domain, "changed its receiver again");
+    }
+  }
+  check_phase("after", moved, REPEAT);
+  tlsrpt_close(&con);
+}
+
+/* Fills the batches, kills receiver 0 before they are flushed and checks that its batch is split up by domain */
+static void check_batched() {
+  if(open_receiver(0)!=0) exit(1);
+  struct tlsrpt_connection_t *con=open_shards();
+  tlsrpt_set_batching(con, 60000, 0);
+  int home[DOMAINS];
+  int moved[DOMAINS];
+
+  for(int domain=0; domain<DOMAINS; ++domain) {
+    home[domain]=get_shard(con, domain);
+    send_delivery_request(con, domain);
+  }
+  kill_receiver(0);
+  tlsrpt_flush(con);
+  collect();
+  for(int domain=0; domain<DOMAINS; ++domain) {
+    moved[domain]=get_shard(con, domain);
+    check(home[domain]==0 || moved[domain]==home[domain], "batched", domain, "moved although its receiver is alive");
+  }
+  check_phase("batched", moved, 1);
+  tlsrpt_close(&con);
+}
+
+/* Exports the delivery requests from a connection with a single socket and finishes them on the sharded connection */
+static void check_imported() {
+  if(open_receiver(0)!=0) exit(1);
+  struct tlsrpt_connection_t *single=NULL;
+  if(tlsrpt_open(&single, socketnames[0])!=0) exit(1);
+  struct tlsrpt_connection_t *con=open_shards();
+  int home[DOMAINS];
+
+  for(int domain=0; domain<DOMAINS; ++domain) {
+    home[domain]=get_shard(con, domain);
+    char domainname[32];
+    snprintf(domainname, sizeof(domainname), "d%d.example", domain);
+    struct tlsrpt_dr_t *dr=NULL;
+    tlsrpt_init_delivery_request(&dr, single, domainname, "v=TLSRPTv1;rua=mailto:reports@example.com");
+    tlsrpt_init_policy(dr, TLSRPT_NO_POLICY_FOUND, NULL);
+    char *buf=NULL;
+    size_t size=0;
+    int res=tlsrpt_export_delivery_request(dr, &buf, &size);
+    tlsrpt_cancel_delivery_request(&dr);
+    if(res==0) res=tlsrpt_import_delivery_request(&dr, con, buf, size);
+    free(buf);
+    if(res!=0) {
+      fprintf(stderr, "importing d%d.example: %s\n", domain, tlsrpt_strerror(res));
+      ++failures;
+      continue;
+    }
+    tlsrpt_finish_policy(dr, TLSRPT_FINAL_SUCCESS);
+    res=tlsrpt_finish_delivery_request(&dr);
+    if(res!=0) fprintf(stderr, "sending d%d.example: %s\n", domain, tlsrpt_strerror(res));
+    collect();
+  }
+  check_phase("imported", home, 1);
+  tlsrpt_close(&con);
+  tlsrpt_close(&single);
+}
+
+/* Fills the batches of all shards and checks that they are held back till their deadline and then sent by tlsrpt_flush_if_due */
+static void check_deadline() {
+  struct tlsrpt_connection_t *con=open_shards();
+  tlsrpt_set_batching(con, 60000, 200);
+  int home[DOMAINS];
+  int next_ms=0;
+
+  for(int domain=0; domain<DOMAINS; ++domain) {
+    home[domain]=get_shard(con, domain);
+    send_delivery_request(con, domain);
+  }
+  tlsrpt_flush_if_due(con, &next_ms);
+  collect();
+  for(int domain=0; domain<DOMAINS; ++domain) {
+    for(int shard=0; shard<SHARDS; ++shard) check(received[domain][shard]==0, "deadline", domain, "was sent before its deadline");
+  }
+  check(next_ms>0 && next_ms<=200, "deadline", 0, "got no wakeup time for its batch");
+  usleep((next_ms+10)*1000);
+  tlsrpt_flush_if_due(con, &next_ms);
+  collect();
+  check(next_ms==-1, "deadline", 0, "left a batch waiting");
+  check_phase("deadline", home, 1);
+  tlsrpt_close(&con);
+}
+
+int main(void) {
+  if(mkdtemp(dir)==NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+  for(int shard=0; shard<SHARDS; ++shard) {
+    snprintf(socketnames[shard], sizeof(socketnames[shard]), "%s/shard%d.socket", dir, shard);
+    if(open_receiver(shard)!=0) return 1;
+  }
+
+  check_unbatched();
+  check_batched();
+  check_imported();
+  check_deadline();
+
+  for(int shard=0; shard<SHARDS; ++shard) {
+    if(receivers[shard]>=0) close(receivers[shard]);
+    unlink(socketnames[shard]);
+  }
+  rmdir(dir);
+  if(failures>0) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  return 0;
+}
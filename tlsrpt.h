@@ -65,6 +65,28 @@ typedef enum {
 } tlsrpt_failure_t;
 
 
+/* The string fields of a failure detail that can have a connection-level default value */
+typedef enum {
+  TLSRPT_FIELD_SENDING_MTA_IP = 0,
+  TLSRPT_FIELD_RECEIVING_MX_HOSTNAME = 1,
+  TLSRPT_FIELD_RECEIVING_MX_HELO = 2,
+  TLSRPT_FIELD_RECEIVING_IP = 3,
+  TLSRPT_FIELD_ADDITIONAL_INFORMATION = 4,
+  TLSRPT_FIELD_FAILURE_REASON_CODE = 5
+} tlsrpt_failure_field_t;
+
+/* Per-connection limits for tlsrpt_set_limit */
+typedef enum {
+  TLSRPT_LIMIT_FAILURES_PER_POLICY = 0,
+  TLSRPT_LIMIT_POLICIES_PER_REQUEST = 1,
+  TLSRPT_LIMIT_BYTES_PER_FIELD = 2,
+  TLSRPT_LIMIT_BYTES_PER_DATAGRAM = 3
+} tlsrpt_limit_t;
+
+/* Pass TLSRPT_USE_DEFAULT instead of a string to use the default value set for the connection */
+extern const char tlsrpt_use_default[];
+#define TLSRPT_USE_DEFAULT tlsrpt_use_default
+
 struct tlsrpt_connection_t;
 struct tlsrpt_dr_t;
 
@@ -76,11 +98,48 @@ const char* tlsrpt_version();
 int tlsrpt_open(struct tlsrpt_connection_t** pcon, const char* socketname);
 int tlsrpt_close(struct tlsrpt_connection_t** pcon);
 
+/* Distributing delivery requests over several TLSRPT collectd sockets by their domain name */
+int tlsrpt_open_shards(struct tlsrpt_connection_t** pcon, const char** socketnames, int count);
+int tlsrpt_get_shard(struct tlsrpt_connection_t* con, const char* domainname);
+
+/* Choosing where finished datagrams are sent, the socket of the TLSRPT collectd is the default */
+int tlsrpt_set_sink_socket(struct tlsrpt_connection_t* con);
+int tlsrpt_set_sink_fd(struct tlsrpt_connection_t* con, int fd);
+int tlsrpt_set_sink_callback(struct tlsrpt_connection_t* con, int (*callback)(void* ctx, char* datagram, size_t size), void* ctx);
+
+/* Default values escaped once per connection, used by passing TLSRPT_USE_DEFAULT */
+int tlsrpt_set_failure_default(struct tlsrpt_connection_t* con, tlsrpt_failure_field_t field, const char* value);
+int tlsrpt_set_policyrecord_default(struct tlsrpt_connection_t* con, const char* domainname, const char* policyrecord);
+
+/* Hard limits for delivery requests, details beyond a limit are dropped and the record is marked as truncated */
+int tlsrpt_set_limit(struct tlsrpt_connection_t* con, tlsrpt_limit_t limit, size_t value);
+
+/* Sending identical failure details of a policy once with their count "k", the TLSRPT collectd must support "k" */
+int tlsrpt_set_deduplication(struct tlsrpt_connection_t* con, int enabled);
+
+/* Optional batching of several delivery requests into one datagram */
+int tlsrpt_set_batching(struct tlsrpt_connection_t* con, size_t max_datagram_size, int max_delay_ms);
+int tlsrpt_flush(struct tlsrpt_connection_t* con);
+int tlsrpt_flush_if_due(struct tlsrpt_connection_t* con, int* next_ms);
+
+/* Send buffer sizing and monitoring of the send queue */
+int tlsrpt_set_sndbuf(struct tlsrpt_connection_t* con, int size);
+int tlsrpt_set_adaptive_sndbuf(struct tlsrpt_connection_t* con, int max_size);
+int tlsrpt_get_send_queue(struct tlsrpt_connection_t* con, int* queued, int* high_water, int* sndbuf);
+
+/* Capture of emitted datagrams into a ring file and replay of such a capture */
+int tlsrpt_set_capture(struct tlsrpt_connection_t* con, const char* filename, size_t size, unsigned int sample_rate);
+int tlsrpt_replay_capture(const char* filename, int (*callback)(void* ctx, const char* data, size_t size, long long timestamp_ns), void* ctx);
+
 /* Handling of a single delivery request, an open connection is required */
   int tlsrpt_init_delivery_request(struct tlsrpt_dr_t** pdr, struct tlsrpt_connection_t* con, const char* domainname, const char* policyrecord);
 int tlsrpt_cancel_delivery_request(struct tlsrpt_dr_t** pdr);
 int tlsrpt_finish_delivery_request(struct tlsrpt_dr_t** pdr);
 
+/* Passing an unfinished delivery request to another process */
+int tlsrpt_export_delivery_request(struct tlsrpt_dr_t* dr, char** pbuf, size_t* psize);
+int tlsrpt_import_delivery_request(struct tlsrpt_dr_t** pdr, struct tlsrpt_connection_t* con, const char* buf, size_t size);
+
 /* Handling of a policy within a delivery request, an initialized delivery request object is required */
 int tlsrpt_init_policy(struct tlsrpt_dr_t* dr, tlsrpt_policy_type_t policy_type, const char* policydomainname);
 int tlsrpt_finish_policy(struct tlsrpt_dr_t* dr, tlsrpt_final_result_t final_result);
@@ -108,8 +167,15 @@ All TLSRPT functions return 0 on success or an individual error code:
 #define TLSRPT_ERR_SOCKET 11000
 #define TLSRPT_ERR_CLOSE 12000
 #define TLSRPT_ERR_SENDTO 13000
+#define TLSRPT_ERR_SENDTO_FLUSH 14000
+#define TLSRPT_ERR_SETSOCKOPT 15000
+#define TLSRPT_ERR_GETSOCKOPT 16000
+#define TLSRPT_ERR_IOCTL 17000
+#define TLSRPT_ERR_WRITEV 18000
 #define TLSRPT_ERR_OPEN_MEMSTREAM_INITDR 21000
 #define TLSRPT_ERR_OPEN_MEMSTREAM_INITPOLICY 22000
+#define TLSRPT_ERR_OPEN_MEMSTREAM_IMPORTDR 23000
+#define TLSRPT_ERR_FFLUSH_EXPORTDR 27000
 #define TLSRPT_ERR_FCLOSE_FINISHPOLICY 28000
 #define TLSRPT_ERR_FCLOSE_FINISHDR 29000
 #define TLSRPT_ERR_FPRINTF_INITDR 31000
@@ -121,6 +187,14 @@ All TLSRPT functions return 0 on success or an individual error code:
 #define TLSRPT_ERR_FPRINTF_FINISHDR 37000
 #define TLSRPT_ERR_MALLOC_OPENCON 41000
 #define TLSRPT_ERR_MALLOC_OPENDR 42000
+#define TLSRPT_ERR_MALLOC_ADDFAILURE 43000
+#define TLSRPT_ERR_MALLOC_SETBATCHING 44000
+#define TLSRPT_ERR_MALLOC_SETDEFAULT 45000
+#define TLSRPT_ERR_MALLOC_EXPORTDR 46000
+#define TLSRPT_ERR_MALLOC_IMPORTDR 47000
+#define TLSRPT_ERR_OPEN_CAPTURE 51000
+#define TLSRPT_ERR_FALLOCATE_CAPTURE 52000
+#define TLSRPT_ERR_MMAP_CAPTURE 53000
 
 
 /*
@@ -132,12 +206,22 @@ The error codes are usually BLOCKNR+errno, but because these internal library er
 #define TLSRPT_ERR_TLSRPT_SOCKETNAMETOOLONG 10711 // The name of the unix domain socket was too long
 #define TLSRPT_ERR_TLSRPT_UNFINISHEDPOLICY 10712 // Call to tlsrpt_init_policy was not properly paired with tlsrpt_finish_policy
 #define TLSRPT_ERR_TLSRPT_NOCONNECTION 10713 // Connection pointer is NULL
+#define TLSRPT_ERR_TLSRPT_NOSOCKETNAME 10714 // No socket name was given
 #define TLSRPT_ERR_TLSRPT_MEMSTREAM_NOT_INITIALIZED 10721 // an internal memstream was not initialized
 #define TLSRPT_ERR_TLSRPT_MEMSTREAMPS_NOT_INITIALIZED 10722 // an internal memstream was not initialized
 #define TLSRPT_ERR_TLSRPT_MEMSTREAMMX_NOT_INITIALIZED 10723 // an internal memstream was not initialized
 #define TLSRPT_ERR_TLSRPT_MEMSTREAMFD_NOT_INITIALIZED 10724 // an internal memstream was not initialized
 #define TLSRPT_ERR_TLSRPT_NESTEDPOLICY 10731 // Two calls to tlsrpt_init_policy without properly calling tlsrpt_finish_policy on the first one
 #define TLSRPT_ERR_TLSRPT_NOPOLICIES 10732 // No policies were added
+#define TLSRPT_ERR_TLSRPT_NOTINPOLICY 10733 // Policy details were added or a policy was finished outside of a policy
+#define TLSRPT_ERR_TLSRPT_CAPTUREINVALID 10741 // The file is not a valid capture file
+#define TLSRPT_ERR_TLSRPT_CALLBACKFAILED 10751 // The callback sink rejected the datagram
+#define TLSRPT_ERR_TLSRPT_NODEFAULT 10761 // No default value was set for the domain or failure detail field
+#define TLSRPT_ERR_TLSRPT_INVALIDFIELD 10762 // Invalid failure detail field
+#define TLSRPT_ERR_TLSRPT_INVALIDLIMIT 10771 // Invalid limit
+#define TLSRPT_ERR_TLSRPT_DOMAINTOOLARGE 10772 // The domain and the policy record alone exceed the datagram limit
+#define TLSRPT_ERR_TLSRPT_INVALIDEXPORT 10781 // The data is not a valid exported delivery request
+#define TLSRPT_ERR_TLSRPT_INVALIDSNDBUF 10791 // Invalid send buffer size
 
 int tlsrpt_errno_from_error_code(int errorcode);
 int tlsrpt_error_code_is_internal(int errorcode);